@@ -0,0 +1,137 @@
+/********************************************************************************
+ *  alloc_main.c                                                                *
+ *  Μετράει τις δεσμεύσεις μνήμης του επιπέδου ΑΜ. Το Makefile (make alloc)     *
+ *  το συνδέει με -Wl,--wrap=malloc κ.λπ., οπότε κάθε malloc, calloc, realloc   *
+ *  και aligned_alloc των AM, BT και PF περνάει από τις __wrap_ συναρτήσεις.    *
+ *  Μία εισαγωγή σε ευρετήριο που έχει ήδη εγγραφές δεν πρέπει να δεσμεύει      *
+ *  μνήμη, και μία αναζήτηση EQUAL το πολύ LOOKUP_ALLOCS φορές.                 *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defn.h"
+#include "AM.h"
+
+#define WARM_UP 20000                  // Inserts before the counting starts
+#define INSERTS 20000
+#define LOOKUPS 20000
+#define LOOKUP_ALLOCS 0                // Per lookup: open, read and close a scan
+
+static long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size)
+{
+	allocations++;
+	return __real_aligned_alloc(alignment, size);
+}
+
+static int lookup(int fd, int key)
+{
+	int scan, found = 0;
+
+	if ((scan = AM_OpenIndexScan(fd, EQUAL, &key)) < 0) {
+		AM_PrintError("Error in AM_OpenIndexScan");
+		return -1;
+	}
+
+	while (AM_FindNextEntry(scan)) {
+		found++;
+	}
+
+	if (AM_errno != AME_EOF) {
+		AM_PrintError("Error in AM_FindNextEntry");
+	}
+
+	AM_CloseIndexScan(scan);
+	return found;
+}
+
+int main()
+{
+	char name[] = "ALLOC-TEST";
+	int fd, i, key, failed = 0;
+	long before;
+
+	AM_Init();
+
+	if (AM_CreateIndex(name, INTEGER, sizeof(int), INTEGER, sizeof(int), 0) != AME_OK ||
+	    (fd = AM_OpenIndex(name)) < 0) {
+		AM_PrintError("Error in AM_CreateIndex/AM_OpenIndex");
+		return 1;
+	}
+
+	srand(1);
+
+	for (i = 0; i < WARM_UP; i++) {
+		key = rand() % (WARM_UP + INSERTS);
+		if (AM_InsertEntry(fd, &key, &i) != AME_OK) {
+			AM_PrintError("Error in AM_InsertEntry");
+		}
+	}
+
+/********************************************************************************
+ *  Εισαγωγές: καμία δέσμευση                                                   *
+ ********************************************************************************/
+	before = allocations;
+
+	for (i = 0; i < INSERTS; i++) {
+		key = rand() % (WARM_UP + INSERTS);
+		if (AM_InsertEntry(fd, &key, &i) != AME_OK) {
+			AM_PrintError("Error in AM_InsertEntry");
+		}
+	}
+
+	printf("%d inserts: %ld allocations\n", INSERTS, allocations - before);
+	if (allocations - before != 0) {
+		printf("FAILED: inserts should not allocate\n");
+		failed = 1;
+	}
+
+/********************************************************************************
+ *  Αναζητήσεις: το πολύ LOOKUP_ALLOCS δεσμεύσεις η καθεμία, μετά την πρώτη     *
+ *  σάρωση, που ετοιμάζει το PF_Page των σαρώσεων                               *
+ ********************************************************************************/
+	lookup(fd, 0);
+	before = allocations;
+
+	for (i = 0; i < LOOKUPS; i++) {
+		lookup(fd, rand() % (WARM_UP + INSERTS));
+	}
+
+	printf("%d lookups: %ld allocations\n", LOOKUPS, allocations - before);
+	if (allocations - before > (long) LOOKUPS * LOOKUP_ALLOCS) {
+		printf("FAILED: more than %d allocations per lookup\n", LOOKUP_ALLOCS);
+		failed = 1;
+	}
+
+	AM_CloseIndex(fd);
+	AM_DestroyIndex(name);
+	AM_Close();
+
+	return failed;
+}
@@ -83,22 +83,22 @@ int main() {
 	 ********************************************************************************/
 
 	if (AM_CreateIndex(empName, STRING, sizeof(empName) - 1, INTEGER,
-			sizeof(int)) != AME_OK) {
+			sizeof(int), 4096) != AME_OK) {
 		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empName);
 		AM_PrintError(errStr);
 	}
 
-	if (AM_CreateIndex(empAge, INTEGER, sizeof(int), STRING, 39) != AME_OK) {
+	if (AM_CreateIndex(empAge, INTEGER, sizeof(int), STRING, 39, 0) != AME_OK) {
 		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empAge);
 		AM_PrintError(errStr);
 	}
 
-	if (AM_CreateIndex(empSal, FLOAT, sizeof(float), STRING, 39) != AME_OK) {
+	if (AM_CreateIndex(empSal, FLOAT, sizeof(float), STRING, 39, 0) != AME_OK) {
 		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empSal);
 		AM_PrintError(errStr);
 	}
 
-	if (AM_CreateIndex(fltname, FLOAT, 39, STRING, 39) != AME_OK) {
+	if (AM_CreateIndex(fltname, FLOAT, 39, STRING, 39, 0) != AME_OK) {
 		sprintf(errStr, "Expected error in AM_CreateIndex called on %s \n",
 				fltname);
 		AM_PrintError(errStr);
@@ -107,7 +107,7 @@ int main() {
 		AM_PrintError(errStr);
 	}
 
-	if (AM_CreateIndex(empDname, STRING, 10, FLOAT, sizeof(float)) != AME_OK) {
+	if (AM_CreateIndex(empDname, STRING, 10, FLOAT, sizeof(float), 0) != AME_OK) {
 		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empDname);
 		AM_PrintError(errStr);
 	}
@@ -208,7 +208,7 @@ int main() {
 	/********************************************************************************
 	 *  Δημιουργία ενός ΒΔ που θα περιέχει πληροφορίες για τμήματα                  *
 	 ********************************************************************************/
-	if (AM_CreateIndex(deptName, STRING, 15, INTEGER, sizeof(int)) != AME_OK) {
+	if (AM_CreateIndex(deptName, STRING, 15, INTEGER, sizeof(int), 0) != AME_OK) {
 		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", deptName);
 		AM_PrintError(errStr);
 	}
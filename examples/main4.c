@@ -0,0 +1,315 @@
+/********************************************************************************
+ *  main4.c                                                                     *
+ *  Παράδειγμα για τις επιπλέον λειτουργίες του επιπέδου ΑΜ: επιλογές           *
+ *  ευρετηρίου, bulk load, εισαγωγές σε δέσμες, BETWEEN, φθίνουσες σαρώσεις,    *
+ *  σαρώσεις IN_LIST, ανάγνωση σε δέσμες, διαγραφή διαστήματος, συμπίεση του    *
+ *  αρχείου, upsert σε ευρετήριο με μοναδικά κλειδιά και διαγραφή διαστήματος   *
+ *  όταν οι εγγραφές ενός κλειδιού πιάνουν πολλά φύλλα.                         *
+ ********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defn.h"
+#include "AM.h"
+
+#define RECORDS 1000
+#define BATCH 200
+
+char empAges[40];
+char empIds[40];
+char empDept[40];
+
+/* Read the scan a batch at a time: print the first <show> (age, id) records
+ * and return how many there are */
+int printScan(int scan, int show)
+{
+	int out[2 * 64], count = 0;
+	size_t n, i;
+	char errStr[200];
+
+	while (AM_FindNextBatch(scan, out, 64, &n) == AME_OK && n) {
+		for (i = 0; i < n; i++, count++) {
+			if (count < show) {
+				printf("%d %d\n", out[2 * i], out[2 * i + 1]);
+			}
+		}
+	}
+
+	if (AM_errno != AME_EOF) {
+		sprintf(errStr, "Error in AM_FindNextBatch called on scan %d \n", scan);
+		AM_PrintError(errStr);
+	}
+
+	AM_CloseIndexScan(scan);
+	return count;
+}
+
+int main()
+{
+	int eAentry, eIentry, eDentry, scan1;
+	int ages[RECORDS], ids[RECORDS];
+	int range[2], list[3];
+	int i, id;
+	float salary, *fvalue;
+	char errStr[200];
+
+	/********************************************************************************
+	 *  Αρχικοποίηση των εσωτερικών δομών του λογισμικού των ΒΔ                     *
+	 ********************************************************************************/
+	AM_Init();
+
+	strcpy(empAges, "EMP-AGES");
+	strcpy(empIds, "EMP-IDS");
+	strcpy(empDept, "EMP-DEPT");
+
+	/********************************************************************************
+	 *  Ευρετήριο ηλικία -> αριθμός υπαλλήλου, με σελίδες 4096 bytes και            *
+	 *  interpolation search στους κόμβους και τα φύλλα                             *
+	 ********************************************************************************/
+	if (AM_CreateIndex(empAges, INTEGER, sizeof(int), INTEGER, sizeof(int),
+			4096) != AME_OK) {
+		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	if ((eAentry = AM_OpenIndex(empAges)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndex called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_SetIndexOption(eAentry, AM_OPT_INTERPOLATION_SEARCH, 1) != AME_OK) {
+		sprintf(errStr, "Error in AM_SetIndexOption called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	/********************************************************************************
+	 *  Bulk load των πρώτων RECORDS - BATCH εγγραφών (δεν χρειάζεται να είναι      *
+	 *  ταξινομημένες) και εισαγωγή των υπολοίπων σε μία δέσμη                      *
+	 ********************************************************************************/
+	for (i = 0; i < RECORDS; i++) {
+		ages[i] = 20 + (i * 7) % 50;
+		ids[i] = i + 1;
+	}
+
+	if (AM_BulkLoad(eAentry, ages, ids, RECORDS - BATCH, 90) != AME_OK) {
+		sprintf(errStr, "Error in AM_BulkLoad called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_InsertBatch(eAentry, ages + RECORDS - BATCH, ids + RECORDS - BATCH,
+			BATCH) != AME_OK) {
+		sprintf(errStr, "Error in AM_InsertBatch called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	/********************************************************************************
+	 *  QUERY #1: πόσοι υπάλληλοι είναι από 30 έως 32 ετών (BETWEEN)                *
+	 ********************************************************************************/
+	printf("\nRESULT OF QUERY #1\n\n");
+
+	range[0] = 30;
+	range[1] = 32;
+
+	if ((scan1 = AM_OpenIndexScan(eAentry, BETWEEN, range)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndexScan called on %s \n", empAges);
+		AM_PrintError(errStr);
+	} else {
+		printf("%d \n", printScan(scan1, 0));
+	}
+
+	/********************************************************************************
+	 *  QUERY #2: οι 5 μεγαλύτεροι κάτω από τα 25 (LESS_THAN | DESCENDING)          *
+	 ********************************************************************************/
+	printf("\nRESULT OF QUERY #2\n\n");
+
+	i = 25;
+	if ((scan1 = AM_OpenIndexScan(eAentry, LESS_THAN | DESCENDING, &i)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndexScan called on %s \n", empAges);
+		AM_PrintError(errStr);
+	} else {
+		printScan(scan1, 5);
+	}
+
+	/********************************************************************************
+	 *  QUERY #3: πόσοι είναι 21, 40 ή 69 ετών (IN_LIST)                            *
+	 ********************************************************************************/
+	printf("\nRESULT OF QUERY #3\n\n");
+
+	list[0] = 69;
+	list[1] = 21;
+	list[2] = 40;
+
+	if ((scan1 = AM_OpenIndexScanIn(eAentry, list, 3)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndexScanIn called on %s \n", empAges);
+		AM_PrintError(errStr);
+	} else {
+		printf("%d \n", printScan(scan1, 0));
+	}
+
+	/********************************************************************************
+	 *  QUERY #4: διαγραφή όσων είναι από 30 έως 39 ετών (AM_DeleteRange, [30, 40)) *
+	 *  και συμπίεση του αρχείου. Μετά μένουν μόνο οι 40 ετών ως τα 40              *
+	 ********************************************************************************/
+	printf("\nRESULT OF QUERY #4\n\n");
+
+	range[0] = 30;
+	range[1] = 40;
+
+	if (AM_DeleteRange(eAentry, &range[0], &range[1]) != AME_OK) {
+		sprintf(errStr, "Error in AM_DeleteRange called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_CompactIndex(eAentry, 100) != AME_OK) {
+		sprintf(errStr, "Error in AM_CompactIndex called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	if ((scan1 = AM_OpenIndexScan(eAentry, BETWEEN, range)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndexScan called on %s \n", empAges);
+		AM_PrintError(errStr);
+	} else {
+		printf("%d \n", printScan(scan1, 0));
+	}
+
+	if (AM_CloseIndex(eAentry) != AME_OK) {
+		sprintf(errStr, "Error in AM_CloseIndex called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	/********************************************************************************
+	 *  Ευρετήριο αριθμός υπαλλήλου -> μισθός, με μοναδικά κλειδιά                  *
+	 ********************************************************************************/
+	if (AM_CreateIndex(empIds, INTEGER, sizeof(int), FLOAT, sizeof(float),
+			0) != AME_OK) {
+		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empIds);
+		AM_PrintError(errStr);
+	}
+
+	if ((eIentry = AM_OpenIndex(empIds)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndex called on %s \n", empIds);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_SetIndexOption(eIentry, AM_OPT_UNIQUE, 1) != AME_OK) {
+		sprintf(errStr, "Error in AM_SetIndexOption called on %s \n", empIds);
+		AM_PrintError(errStr);
+	}
+
+	for (id = 1; id <= 10; id++) {
+		salary = 100 * id;
+		if (AM_InsertEntry(eIentry, &id, &salary) != AME_OK) {
+			sprintf(errStr, "Error in AM_InsertEntry called on %s \n", empIds);
+			AM_PrintError(errStr);
+		}
+	}
+
+	/********************************************************************************
+	 *  QUERY #5: δεύτερη εγγραφή με τον αριθμό 5 (αποτυγχάνει) και αύξηση του      *
+	 *  μισθού του με AM_Upsert                                                     *
+	 ********************************************************************************/
+	printf("\nRESULT OF QUERY #5\n\n");
+
+	id = 5;
+	salary = 550;
+
+	if (AM_InsertEntry(eIentry, &id, &salary) != AME_OK) {
+		sprintf(errStr, "Second record of 5 in %s (Note: This is the correct behaviour!)", empIds);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_Upsert(eIentry, &id, &salary) != AME_OK) {
+		sprintf(errStr, "Error in AM_Upsert called on %s \n", empIds);
+		AM_PrintError(errStr);
+	}
+
+	if ((scan1 = AM_OpenIndexScan(eIentry, EQUAL, &id)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndexScan called on %s \n", empIds);
+		AM_PrintError(errStr);
+	} else {
+		if ((fvalue = (float *) AM_FindNextEntry(scan1)) != NULL) {
+			printf("%.1f \n", *fvalue);
+		}
+
+		AM_CloseIndexScan(scan1);
+	}
+
+	if (AM_CloseIndex(eIentry) != AME_OK) {
+		sprintf(errStr, "Error in AM_CloseIndex called on %s \n", empIds);
+		AM_PrintError(errStr);
+	}
+
+	/********************************************************************************
+	 *  QUERY #6: τμήμα -> αριθμός υπαλλήλου, με σελίδες BF_BLOCK_SIZE, ώστε οι     *
+	 *  200 υπάλληλοι του τμήματος 5 και οι 200 του 7 να πιάνουν πολλά φύλλα.       *
+	 *  Η διαγραφή του [5, 6) σβήνει όλους του 5 και κανέναν του 7                  *
+	 ********************************************************************************/
+	printf("\nRESULT OF QUERY #6\n\n");
+
+	if (AM_CreateIndex(empDept, INTEGER, sizeof(int), INTEGER, sizeof(int),
+			0) != AME_OK) {
+		sprintf(errStr, "Error in AM_CreateIndex called on %s \n", empDept);
+		AM_PrintError(errStr);
+	}
+
+	if ((eDentry = AM_OpenIndex(empDept)) < 0) {
+		sprintf(errStr, "Error in AM_OpenIndex called on %s \n", empDept);
+		AM_PrintError(errStr);
+	}
+
+	for (id = 1; id <= 200; id++) {
+		list[0] = 5;
+		list[1] = 7;
+		if (AM_InsertEntry(eDentry, &list[0], &id) != AME_OK ||
+				AM_InsertEntry(eDentry, &list[1], &id) != AME_OK) {
+			sprintf(errStr, "Error in AM_InsertEntry called on %s \n", empDept);
+			AM_PrintError(errStr);
+		}
+	}
+
+	range[0] = 5;
+	range[1] = 6;
+
+	if (AM_DeleteRange(eDentry, &range[0], &range[1]) != AME_OK) {
+		sprintf(errStr, "Error in AM_DeleteRange called on %s \n", empDept);
+		AM_PrintError(errStr);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((scan1 = AM_OpenIndexScan(eDentry, EQUAL, &list[i])) < 0) {
+			sprintf(errStr, "Error in AM_OpenIndexScan called on %s \n", empDept);
+			AM_PrintError(errStr);
+		} else {
+			printf("%d: %d \n", list[i], printScan(scan1, 0));
+		}
+	}
+
+	if (AM_CloseIndex(eDentry) != AME_OK) {
+		sprintf(errStr, "Error in AM_CloseIndex called on %s \n", empDept);
+		AM_PrintError(errStr);
+	}
+
+	/********************************************************************************
+	 *  Διαγραφή των ΒΔ του παραδείγματος                                           *
+	 ********************************************************************************/
+	if (AM_DestroyIndex(empAges) != AME_OK) {
+		sprintf(errStr, "Error in AM_DestroyIndex called on %s \n", empAges);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_DestroyIndex(empIds) != AME_OK) {
+		sprintf(errStr, "Error in AM_DestroyIndex called on %s \n", empIds);
+		AM_PrintError(errStr);
+	}
+
+	if (AM_DestroyIndex(empDept) != AME_OK) {
+		sprintf(errStr, "Error in AM_DestroyIndex called on %s \n", empDept);
+		AM_PrintError(errStr);
+	}
+
+	AM_Close();
+
+	return 0;
+}
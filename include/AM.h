@@ -1,6 +1,8 @@
 #ifndef AM_H_
 #define AM_H_
 
+#include <stddef.h>
+
 /* Error codes */
 
 extern int AM_errno;
@@ -19,6 +21,13 @@ extern int AM_errno;
 #define AME_MAX_OPEN_FILES -11
 #define AME_MAX_SCANS -12
 #define AME_NOT_A_BT_FILE -13
+#define AME_INVALID_OPTION -14
+#define AME_INVALID_PAGE_SIZE -15
+#define AME_INVALID_FILL_FACTOR -16
+#define AME_NOT_FOUND -17
+#define AME_DUPLICATE_KEY -18
+#define AME_NOT_UNIQUE -19
+#define AME_REPLACE_ERROR -20
 
 #define EQUAL 1
 #define NOT_EQUAL 2
@@ -26,6 +35,22 @@ extern int AM_errno;
 #define GREATER_THAN 4
 #define LESS_THAN_OR_EQUAL 5
 #define GREATER_THAN_OR_EQUAL 6
+#define BETWEEN 7                      /* low <= key <= high */
+#define IN_LIST 8                      /* AM_OpenIndexScanIn */
+#define DESCENDING 16                  /* | op: from the largest key down (not with IN_LIST) */
+
+/* Index options (AM_SetIndexOption) */
+#define AM_OPT_INTERPOLATION_SEARCH 1  /* 0/1: guess key positions ('i'/'f' keys) */
+#define AM_OPT_SPLIT_LAYOUT 2          /* 0/1: vectorized blocks ('i'/'f' keys, empty index) */
+#define AM_OPT_PREFIX_COMPRESSION 3    /* 0/1: common key prefix once per block ('c' keys, empty index) */
+#define AM_OPT_MESSAGE_BUFFERS 4       /* 0/1: write-optimized, inserts buffered in nodes (empty index) */
+#define AM_OPT_MEMTABLE 5              /* records held in memory before a merge (0: none). Per open */
+#define AM_OPT_REDISTRIBUTE 6          /* 0/1: B* inserts, full leaves share with siblings (not with 3/9) */
+#define AM_OPT_UNIQUE 7                /* 0/1: one record per key (empty index, not with 4/5) */
+#define AM_OPT_POSTING_LISTS 8         /* 0/1: many records of a key, one list of values (empty index, not with 2/3/7) */
+#define AM_OPT_TOP_DOWN 9              /* 0/1: inserts split full nodes on the way down (not with 3/4/6) */
+#define AM_OPT_FILL_FACTOR 10          /* percent of a block that stays in it on a split: 1-100, 0 for half */
+#define AM_OPT_ADAPTIVE_SPLIT 11       /* 0/1: leaves under ascending, descending or clustered inserts split at the new key */
 
 void AM_Init( void );
 
@@ -33,9 +58,10 @@ void AM_Init( void );
 int AM_CreateIndex(
   char *fileName, /* όνομα αρχείου */
   char attrType1, /* τύπος πρώτου πεδίου: 'c' (συμβολοσειρά), 'i' (ακέραιος), 'f' (πραγματικός) */
-  int attrLength1, /* μήκος πρώτου πεδίου: 4 γιά 'i' ή 'f', 1-255 γιά 'c' */
+  int attrLength1, /* μήκος πρώτου πεδίου: 4 για 'i' ή 'f', 1-255 για 'c' */
   char attrType2, /* τύπος πρώτου πεδίου: 'c' (συμβολοσειρά), 'i' (ακέραιος), 'f' (πραγματικός) */
-  int attrLength2 /* μήκος δεύτερου πεδίου: 4 γιά 'i' ή 'f', 1-255 γιά 'c' */
+  int attrLength2, /* μήκος δεύτερου πεδίου: 4 για 'i' ή 'f', 1-255 για 'c' */
+  int pageSize /* μέγεθος σελίδας σε bytes: 0 (BF_BLOCK_SIZE) ή δύναμη του 2 έως 65536 (π.χ. 4096, 8192, 16384) */
 );
 
 
@@ -54,6 +80,13 @@ int AM_CloseIndex (
 );
 
 
+int AM_SetIndexOption(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  int option, /* επιλογή (AM_OPT_*) */
+  int value /* νέα τιμή της επιλογής */
+);
+
+
 int AM_InsertEntry(
   int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
   void *value1, /* τιμή του πεδίου-κλειδιού προς εισαγωγή */
@@ -61,10 +94,74 @@ int AM_InsertEntry(
 );
 
 
+int AM_UpdateEntry(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  void *value1, /* τιμή του πεδίου-κλειδιού της εγγραφής */
+  void *old_value2, /* τρέχουσα τιμή του δεύτερου πεδίου */
+  void *new_value2 /* νέα τιμή του δεύτερου πεδίου */
+);
+
+
+int AM_Upsert(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο (μοναδικά κλειδιά) */
+  void *value1, /* τιμή του πεδίου-κλειδιού */
+  void *value2 /* τιμή του δεύτερου πεδίου, νέα ή στη θέση της υπάρχουσας */
+);
+
+
+int AM_DeleteEntry(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  void *value1, /* τιμή του πεδίου-κλειδιού προς διαγραφή */
+  void *value2 /* τιμή του δεύτερου πεδίου, ή NULL για όλες τις εγγραφές με το κλειδί */
+);
+
+
+int AM_DeleteRange(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  void *low, /* πρώτη τιμή του πεδίου-κλειδιού προς διαγραφή, ή NULL για την αρχή */
+  void *high /* τιμή του πεδίου-κλειδιού μετά τις διαγραφόμενες, ή NULL για το τέλος */
+);
+
+
+int AM_BulkLoad(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  void *value1, /* πίνακας count τιμών του πεδίου-κλειδιού, attrLength1 bytes η καθεμία */
+  void *value2, /* πίνακας count τιμών του δεύτερου πεδίου, attrLength2 bytes η καθεμία */
+  int count, /* πλήθος εγγραφών (ταξινομημένων ή όχι) */
+  int fillFactor /* ποσοστό πλήρωσης των blocks: 1-100, 0 για 100 */
+);
+
+
+int AM_InsertBatch(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  const void *keys, /* πίνακας n τιμών του πεδίου-κλειδιού, attrLength1 bytes η καθεμία */
+  const void *values, /* πίνακας n τιμών του δεύτερου πεδίου, attrLength2 bytes η καθεμία */
+  size_t n /* πλήθος εγγραφών */
+);
+
+
+int AM_MergeMemtable(
+  int fileDesc /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+);
+
+
+int AM_CompactIndex(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  int fillFactor /* ποσοστό πλήρωσης των blocks: 1-100, 0 για 100 */
+);
+
+
 int AM_OpenIndexScan(
   int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
-  int op, /* τελεστής σύγκρισης */
-  void *value /* τιμή του πεδίου-κλειδιού προς σύγκριση */
+  int op, /* τελεστής σύγκρισης, | DESCENDING για φθίνουσα σειρά */
+  void *value /* τιμή του πεδίου-κλειδιού προς σύγκριση (για BETWEEN δύο τιμές στη σειρά, low και high) */
+);
+
+
+int AM_OpenIndexScanIn(
+  int fileDesc, /* αριθμός που αντιστοιχεί στο ανοιχτό αρχείο */
+  void *values, /* πίνακας count τιμών του πεδίου-κλειδιού (attrLength1 bytes η καθεμία) */
+  int count /* πλήθος τιμών, τουλάχιστον 1 */
 );
 
 
@@ -73,6 +170,14 @@ void *AM_FindNextEntry(
 );
 
 
+int AM_FindNextBatch(
+  int scanDesc, /* αριθμός που αντιστοιχεί στην ανοιχτή σάρωση */
+  void *out, /* χώρος για max εγγραφές: κλειδί (attrLength1 bytes) και δεύτερο πεδίο (attrLength2 bytes) η καθεμία */
+  size_t max, /* μέγιστο πλήθος εγγραφών */
+  size_t *n /* πλήθος εγγραφών που αντιγράφηκαν, 0 στο τέλος της σάρωσης */
+);
+
+
 int AM_CloseIndexScan(
   int scanDesc /* αριθμός που αντιστοιχεί στην ανοιχτή σάρωση */
 );
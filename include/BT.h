@@ -2,20 +2,30 @@
 #define BT_H
 
 #include <limits.h>
+#include <stddef.h>
+
+#include "PF.h"
 
 /* B-Tree methods header.
  * Defines useful functions like record and key accessors, block splits e.t.c.
  * Used by AM as an interface to our low-level B+ Tree implementation.
  */
 
-#define BT_IDENTIFIER "%BTDB"
+#define BT_IDENTIFIER "%BTD2"           // Leaves with prev_block
+#define BT_MAX_KEY 256                 // Upper bound for any key/value length
+
+/* Small stack implementation, for the path down the tree.
+ * Fixed depth: a node holds at least 2 pointers, and a file at most INT_MAX
+ * pages, so no tree is taller */
+#define STACK_DEPTH 32
 
-// Small stack implementation
-struct stack_node;
+struct stack {
+	int count;
+	int data[STACK_DEPTH];
+};
 
-void stack_push(struct stack_node **top, int);
-int stack_pop(struct stack_node **top);
-void stack_destroy(struct stack_node **top);
+void stack_push(struct stack*, int);
+int stack_pop(struct stack*);          // 0 if empty
 
 
 typedef struct BT_Header {
@@ -25,16 +35,112 @@ typedef struct BT_Header {
 	int root;
 	int data_head;                         // Pointer to leftmost data block
 	int data_tail;                        // Pointer to rightmost data block
+	int flags;                             // Index options (BT_* below)
+	int page_size;                         // In bytes, never 0
+	int free_head;                         // First free page (0 if none)
+	int free_leaves;                       // First of a chain of free leaves
+	int fill_factor;                       // Percent a split block keeps (0: half)
 } BT_Header;
 
+// BT_Header.flags
+#define BT_INTERPOLATION_SEARCH 0x1   // Guess key positions ('i'/'f' only)
+#define BT_SPLIT_LAYOUT 0x2           // Keys apart from pointers/values ('i'/'f')
+#define BT_PREFIX_COMPRESSION 0x4     // Common key prefix stored once per block ('c')
+#define BT_MESSAGE_BUFFERS 0x8        // Inserts wait in node buffers (not with 0x4)
+#define BT_REDISTRIBUTE 0x10          // Full leaves share with siblings (B*, not with 0x4)
+#define BT_UNIQUE 0x20                // One record per key (not with 0x8)
+#define BT_POSTING_LISTS 0x40         // Runs of a key as posting lists (not 0x2/0x4/0x20)
+#define BT_TOP_DOWN 0x80              // Full nodes split on the way down (not 0x4/0x8/0x10)
+#define BT_ADAPTIVE_SPLIT 0x100       // Leaves under skewed inserts split at the new key
+
+// Where the i-th element of an array in a block lives: offset + i * stride
+struct bt_array {
+	int offset;
+	int stride;
+};
+
+/* Recent inserts into a leaf (BT_ADAPTIVE_SPLIT): the position of the last
+ * one and how many in a row went next to the one before */
+struct bt_history {
+	int page;                              // The leaf (0 for none)
+	int last;
+	int run;
+};
+
+#define BT_HISTORY 64                  // Leaves followed, by page number
+
+/* Key range of a leaf: the separators either side of the pointer to it.
+ * Keys in [low, high) go to the leaf. A missing bound is open */
+struct bt_bounds {
+	int has_low, has_high;
+	char low[BT_MAX_KEY];
+	char high[BT_MAX_KEY];
+};
+
 /* Struct with info for the file
  * - "Caches" header to avoid reading blocks when we update something */
 struct file_entry {
 	char name[40];
-	int fd;
+	PF_File pf;                            // Pages of the BF file pf.fd
 	BT_Header header;
+
+	// Derived from the header by bt_layout(), once per open
+	int key_size, value_size, record_size;
+	int (*compare)(const void *key, const void *value, size_t key_size);
+
+	// Block layout, also worked out by bt_layout()
+	struct bt_array node_pointers, node_keys;
+	struct bt_array leaf_keys, leaf_values;
+	int max_keys;                          // (key, pointer) pairs per node
+	int max_records;                       // Records per leaf
+
+	/* Posting lists (BT_POSTING_LISTS, 0 otherwise): offset of the tag of a
+	 * leaf record, after its value, and the longest run of a key a leaf
+	 * keeps before the run becomes a posting list */
+	int posting_tag;
+	int max_run;
+
+	/* Message buffer of a node (BT_MESSAGE_BUFFERS, 0 otherwise): records
+	 * on their way down, in key order. | count | [key value] | ... | */
+	int buffer_offset;
+	int max_messages;
+
+	/* Vectorized key search for the split layout (NULL otherwise).
+	 * Counts the keys < value (or <= value, if upper) */
+	int (*count_keys)(const char *keys, int n, const void *value, int upper);
+
+	char *scratch;                         // One page, for rebuilding blocks
+	char *posting_scratch;                 // One more, for posting pages
+
+	/* Page handles, made once per open. Each holds at most one page at a
+	 * time: <search_page> is for bt_search, <split_page> for the new block
+	 * of a split, <parent_page>, <child_page> and <sibling_page> (of the
+	 * child) for the AM calls, <posting_page> and <posting_other> for the
+	 * pages of a posting list */
+	PF_Page *search_page, *split_page, *parent_page, *child_page, *sibling_page;
+	PF_Page *posting_page, *posting_other;
+
+	/* Finger: the leaf the last insert went to (0 if none) and its range.
+	 * Inserts within the range, as in ascending loads, skip the descent */
+	int finger;
+	struct bt_bounds finger_bounds;
+
+	// Insert positions in recently written leaves, for the split points
+	struct bt_history history[BT_HISTORY];
+
+	// Leaves the next sequential scan reads ahead of itself (AM.c)
+	int read_ahead;
+
+	/* Memtable (AM_OPT_MEMTABLE, memtable_size 0 otherwise): records not
+	 * yet in the tree, in key order. Normalized keys apart from values */
+	char *memtable_keys, *memtable_values;
+	int memtable_count, memtable_size;
 };
 
+/* Fill in the sizes, comparator and block layout of <file> according to its
+ * header. Must be called again whenever the layout flags change */
+void bt_layout(struct file_entry*);
+
 
 // Index block
 typedef struct BT_Node {
@@ -43,39 +149,140 @@ typedef struct BT_Node {
 	char array[];
 } BT_Node;
 
-// Return node->pointer[i] (pointer | key | pointer | key | pointer ...)
+/* Return node->pointer[i]. Default layout: (pointer | key | pointer | ... )
+ * Split layout: (pointer | pointer | ... | key | key | ...)
+ * Prefix compression: (prefix | pointer | key suffix | pointer | ... ) */
 int *pointer(struct file_entry*, BT_Node*, int i);
-int node_full(struct file_entry*, BT_Node*);
 
-/* Split index block by creating a new block and copying over half of the
- * (key, value) pairs from the previous block */
-int split_node(struct file_entry*, BT_Node*, void *key_up);
+// Return node->key[i] (just its stored suffix, if prefix compressed)
+void *key(struct file_entry*, BT_Node*, int i);
+
+// Copy key i of the node, in full, to <dst>
+void node_key(struct file_entry*, BT_Node*, int i, void *dst);
+
+// Store <value> as key i (its packed part, if prefix compressed)
+void set_key(struct file_entry*, BT_Node*, int i, void *value);
+
+// Index of the pointer to follow for <value>. Equal keys send us to the right
+int node_find(struct file_entry*, BT_Node*, void *value);
+
+/* Index of the pointer to the first child that may hold <value>: equal keys
+ * send us to the left, where a run of them may start */
+int node_find_first(struct file_entry*, BT_Node*, void *value);
+
+// Is there no room left for <key>? (Prefix compressed nodes fit fewer long keys)
+int node_full(struct file_entry*, BT_Node*, void *key);
+
+/* Split index block by creating a new block and copying over the (key, value)
+ * pairs past header.fill_factor percent of the block (half if 0, or if <key>
+ * would fall on the larger side), with their buffered messages */
+int split_node(struct file_entry*, BT_Node*, void *key, void *key_up);
 
 // Insert a (key, pointer) pair into the node under the assumption that it can fit
 void insert_node_nonfull(struct file_entry*, BT_Node*, void *key, int);
 
+/* insert_node_nonfull() of <right>, split from <left>, right after the pointer
+ * to <left>. Without posting lists a run of equal keys can go on over several
+ * leaves, and then their separators repeat: the key alone doesn't say which
+ * of them <right> follows */
+void insert_node_after(struct file_entry*, BT_Node*, int left, void *key, int right);
+
+// Index of the pointer to <page> in the node, or -1
+int node_child(struct file_entry*, BT_Node*, int page);
+
+// Drop key i of the node and the pointer to its right
+void remove_key(struct file_entry*, BT_Node*, int i);
+
+// Drop keys [from, to) of the node and the pointers to their right
+void remove_keys(struct file_entry*, BT_Node*, int from, int to);
+
+/* Rebalance two neighbouring nodes (left before right), one of them short of
+ * keys after a delete. <sep> is the key between them in the parent.
+ * Returns 1 if they merged into <left>, with <sep> pulled down between them
+ * (<right> is left empty), 0 if (key, pointer) pairs were moved across
+ * through the parent instead so that they hold about half each (<sep> is
+ * then their new key), or -1 if neither can be done. Buffered messages go
+ * along with the children they are bound for. Prefix compressed nodes only
+ * merge, as a new key might not fit the parent's packing */
+int join_nodes(struct file_entry*, BT_Node *left, BT_Node *right, void *sep);
+
+// Number of messages buffered in the node
+int *message_count(struct file_entry*, BT_Node*);
+
+// Return pointer to message[i][field], as record() does for leaves
+void *message(struct file_entry*, BT_Node*, int i, int field);
+
+// First message with key > value (upper != 0) or >= value (upper == 0)
+int message_bound(struct file_entry*, BT_Node*, void *value, int upper);
+
+// Buffer a message after any with an equal key, under the assumption that it can fit
+void buffer_message(struct file_entry*, BT_Node*, void *key, void *value);
+
+// Drop messages [from, to) from the buffer
+void unbuffer_messages(struct file_entry*, BT_Node*, int from, int to);
+
 
 // Data block
 typedef struct BT_Leaf {
 	int record_count : sizeof(int) * CHAR_BIT - 1;
 	int is_leaf      : 1;
 	int next_block;
+	int prev_block;                // Both 0 at the ends of the data list
 	char records[];                // Variable length records (same for all)
 } BT_Leaf;
 
+/* Free list: blocks given back by deletes, linked through their first int
+ * from header.free_head. Whole runs of leaves dropped at once (AM_DeleteRange)
+ * keep their data list links instead, from header.free_leaves. New blocks are
+ * taken from these lists before the file grows.
+ * bt_allocate() pins a zeroed page in <page> and returns its number in
+ * <page_num>. bt_free() puts the page pinned in <page> on the list (and
+ * unpins it) */
+BF_ErrorCode bt_allocate(struct file_entry*, PF_Page *page, int *page_num);
+void bt_free(struct file_entry*, PF_Page *page, int page_num);
+
 /* Allocate a new block and set the is_leaf identifier to 1.
  * That identifier is how we know to stop the search */
-BT_Leaf *create_leaf(int fd, BF_Block**);
+BT_Leaf *create_leaf(struct file_entry*, PF_Page**, int *page_num);
+
+// Point the prev_block of leaf <page> (if not 0) to <prev>
+void link_prev(struct file_entry*, int page, int prev);
 
 /* Return pointer to leaf->record[i][field]
- * Leaf records layout: | [field1 field2] | [field1 field2] | ... */
+ * Default layout: | [field1 field2] | [field1 field2] | ...
+ * Split layout: | field2 | field2 | ... | field1 | field1 | ...
+ * Prefix compression: | prefix | [field1 suffix, field2] | ...
+ * (a prefix compressed key is read in full with leaf_key) */
 void *record(struct file_entry*, BT_Leaf*, int i, int field);
-int leaf_full(struct file_entry*, BT_Leaf*);
 
-/* Split data block (leaf). More details in definition.
+// Copy the key of record i, in full, to <dst>
+void leaf_key(struct file_entry*, BT_Leaf*, int i, void *dst);
+int leaf_full(struct file_entry*, BT_Leaf*, void *key);
+
+/* Split data block (leaf), at page <page>. More details in definition.
  * Also update the list pointers (next_block, head, tail)
- * Returns position of new block, key_up */
-int split_leaf(struct file_entry*, BT_Leaf*, void *key_up);
+ * Leaves room for <key> on the side it will go to. A <key> past the end of
+ * the rightmost leaf leaves it full and starts the new leaf instead. So does
+ * any leaf whose recent inserts bt_note_insert() found skewed, at <key>.
+ * Returns position of new block, key_up: the shortest key that separates
+ * the two leaves, not necessarily one in the tree */
+int split_leaf(struct file_entry*, BT_Leaf*, int page, void *key, void *key_up);
+
+// Record at position i went into the leaf at <page> (for BT_ADAPTIVE_SPLIT)
+void bt_note_insert(struct file_entry*, int page, int i);
+
+/* B* redistribution between neighbouring leaves (left before right): move
+ * records across them so that, with <key>, they hold about half each. Returns
+ * 0, moving nothing, if that leaves no room for <key> on its side or cuts a
+ * run of equal keys. Otherwise <sep> is their new separator */
+int share_leaves(struct file_entry*, BT_Leaf *left, BT_Leaf *right, void *key, void *sep);
+
+/* B* split of two full neighbouring leaves into three, about two thirds full
+ * each. The new leaf goes between them, in the data list too. Returns its
+ * position and the separators before and after it, or 0 (changing nothing)
+ * under the same conditions as share_leaves() */
+int split_leaves(struct file_entry*, BT_Leaf *left, BT_Leaf *right, void *key,
+                 void *sep_low, void *sep_high);
 
 // Find the first instance of <value> in the leaf
 int leaf_find_first(struct file_entry*, BT_Leaf*, void *value);
@@ -85,15 +292,98 @@ int leaf_find_first(struct file_entry*, BT_Leaf*, void *value);
  * leaf_find_last() will be less than leaf_find_first(), so we know we're done */
 int leaf_find_last(struct file_entry*, BT_Leaf*, void *value);
 
-// Insert a new record into the leaf under the assumption that it can fit
-void insert_leaf_nonfull(struct file_entry*, BT_Leaf*, void *value1, void *value2);
+/* Insert a new record into the leaf under the assumption that it can fit.
+ * Returns its position, or -1 (leaf unchanged) if the index is BT_UNIQUE and
+ * the key is there already */
+int insert_leaf_nonfull(struct file_entry*, BT_Leaf*, void *value1, void *value2);
+
+// Drop records [from, to) of the leaf
+void remove_records(struct file_entry*, BT_Leaf*, int from, int to);
+
+/* join_nodes() for leaves: merge (out of the data list goes <right>) or share.
+ * Cuts fall between runs of equal keys. Prefix compressed leaves only merge */
+int join_leaves(struct file_entry*, BT_Leaf *left, BT_Leaf *right, void *sep);
+
+/* Posting lists (BT_POSTING_LISTS)
+ * A run of max_run records with the same key becomes a single record, tagged,
+ * whose value is the first page of a list of the run's values. Later records
+ * with the key only go into the list, so a leaf never holds a run it can't
+ * keep whole. The list is a chain of pages with the values in order, 'i'
+ * values delta coded:
+ * | next | count | used | tail | last value | first value | delta | delta | ...
+ * (tail, the last page of the chain, is kept in the first page only) */
+typedef struct BT_Posting {
+	int next;                              // Next page of the list (0: none)
+	int count;                             // Values in this page
+	int used;                              // Bytes of them
+	int tail;
+	char data[];
+} BT_Posting;
+
+// Position in a posting list, for scans
+struct bt_posting_cursor {
+	int page;                              // 0: not in a list
+	int entry, offset;                     // Next value of the page to read
+	char value[BT_MAX_KEY];                // The last one read
+};
+
+// First page of the posting list record i of the leaf stands for (0 if none)
+int leaf_posting(struct file_entry*, BT_Leaf*, int i);
+
+// Add <value> to the list starting at page <head>
+void posting_insert(struct file_entry*, int head, void *value);
+
+/* Drop the values equal to <value> (all of them, and the pages, if NULL) from
+ * the list at <head>. Returns how many went. The first page stays unless
+ * <value> is NULL, even if the list is left empty (see posting_empty) */
+int posting_remove(struct file_entry*, int head, void *value);
+int posting_empty(struct file_entry*, int head);
+
+/* The next value of the list at <head> after <cursor>, which must start with
+ * page 0. NULL at the end, with <cursor> back at the start */
+void *posting_next(struct file_entry*, struct bt_posting_cursor*, int head);
+
+/* Drop the values equal to <value2> (all, if NULL) from records [from, to) of
+ * the leaf, posting lists included. Returns how many went */
+int remove_values(struct file_entry*, BT_Leaf*, int from, int to, void *value2);
 
 
 // General B-Tree functions
+/* Keys are stored and searched in normalized form: an encoding whose order
+ * under file->compare matches the order of the original values.
+ * 'i': as is, 'f': float bits reordered to compare as ints,
+ * 'c': zero-padded after the terminator, to compare with memcmp.
+ * <dst> must hold key_size bytes */
+void normalize_key(struct file_entry*, void *dst, void *key);
+void denormalize_key(struct file_entry*, void *dst, void *key);
+
 // Similar to memcmp and the like, but knowing the size_t n (key_size)
 int compare_key(struct file_entry*, void *key, void *value);
 
+/* Cut <first> down to the shortest key that still sorts after <last>, to
+ * separate the two in the index. For strings: up to the first byte where they
+ * differ, zero-padded like any normalized string. Shorter separators pack
+ * into more prefix compressed index entries. Numeric keys stay as they are */
+void separator_key(struct file_entry*, void *last, void *first);
+
+/* Binary search over n keys placed <stride> bytes apart, starting at <base>.
+ * Returns the first key > value (upper != 0) or >= value (upper == 0).
+ * Narrows the range by interpolation first if the index asks for it */
+int key_bound(struct file_entry*, char *base, int stride, int n, void *value, int upper);
+
 // Search the tree to find the leaf node where a record with key <key> belongs.
-int bt_search(struct file_entry*, void *key, struct stack_node **parent);
+int bt_search(struct file_entry*, void *key, struct stack *parent);
+
+/* The first leaf that may hold a record with key <key>. bt_search() goes to
+ * the last one: without posting lists a run of equal keys can go on over
+ * several leaves. 0 if a block on the way cannot be read */
+int bt_search_first(struct file_entry*, void *key);
+
+// bt_search() that also finds the key range of the leaf
+int bt_search_bounded(struct file_entry*, void *key, struct stack *parent,
+                      struct bt_bounds *bounds);
+
+// Is <key> in the range?
+int bt_in_bounds(struct file_entry*, struct bt_bounds*, void *key);
 
 #endif // BT_H
@@ -0,0 +1,65 @@
+#ifndef PF_H
+#define PF_H
+
+#include "bf.h"
+
+/* Paged file header.
+ * Serves fixed-size pages of any multiple of BF_BLOCK_SIZE on top of a BF
+ * file. Page n is made of the BF blocks [n * k, (n + 1) * k), k being the
+ * number of blocks per page.
+ * - Pages of BF_BLOCK_SIZE are BF blocks, passed through as they are.
+ * - Larger pages are assembled in a per-file cache of contiguous frames and
+ *   written back block by block when evicted or when the file is closed.
+ * The calls mirror their BF counterparts and return BF error codes. */
+
+#define PF_MAX_PAGE_SIZE 65536
+#define PF_CACHE_SIZE (2 * 1024 * 1024)  // Bytes of frames per file (k > 1)
+#define PF_MIN_FRAMES 16
+
+struct pf_frame;
+
+typedef struct PF_File {
+	int fd;                                // Underlying BF file
+	int page_size;
+	int blocks;                            // BF blocks per page (k)
+
+	// Page cache (k > 1 only)
+	struct pf_frame *frames;
+	struct pf_frame **buckets;             // Hash of cached pages
+	int frame_count;
+	int hand;                              // Clock replacement position
+	BF_Block *io;                          // For copying blocks in and out
+} PF_File;
+
+typedef struct PF_Page {
+	PF_File *file;
+	BF_Block *block;                       // k == 1
+	struct pf_frame *frame;                // k > 1
+} PF_Page;
+
+// Is <page_size> something PF can serve?
+int PF_ValidPageSize(int page_size);
+
+void PF_Page_Init(PF_Page **page);
+void PF_Page_Destroy(PF_Page **page);
+void PF_Page_SetDirty(PF_Page *page);
+char *PF_Page_GetData(const PF_Page *page);
+
+// Start serving <page_size> pages from the (already open) BF file <fd>
+BF_ErrorCode PF_OpenFile(PF_File *file, int fd, int page_size);
+
+// Write back any cached pages. Doesn't close the BF file
+BF_ErrorCode PF_CloseFile(PF_File *file);
+
+BF_ErrorCode PF_GetPageCounter(PF_File *file, int *pages_num);
+BF_ErrorCode PF_AllocatePage(PF_File *file, PF_Page *page);
+BF_ErrorCode PF_GetPage(PF_File *file, int page_num, PF_Page *page);
+BF_ErrorCode PF_UnpinPage(PF_Page *page);
+
+/* Read <pages> (up to <count>) in ahead of their use, without pinning them.
+ * BF has no asynchronous reads: the reads are only brought together, in the
+ * order of the pages in the file (<pages> gets sorted). Cached pages are
+ * skipped, and at most a quarter of the cache is taken */
+BF_ErrorCode PF_Prefetch(PF_File *file, int *pages, int count);
+
+#endif // PF_H
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 
 #include "AM.h"
 #include "bf.h"
+#include "PF.h"
 #include "BT.h"
 
 #define CALL_BF(call)                    \
@@ -20,6 +22,11 @@
 #define MAX_OPEN_FILES 20
 #define MAX_SCANS 20
 
+// Read-ahead of scans, in leaves (further down)
+#define READ_AHEAD_AFTER 2
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 32
+
 static struct open_files {
 	unsigned int count;
 	struct file_entry *entry[MAX_OPEN_FILES];
@@ -28,20 +35,53 @@ static struct open_files {
 struct scan_entry {
 	int fileDesc;
 	int op;
-	void *value;
-	int current_block;
+	char value[BT_MAX_KEY];                // Normalized copy of the key
+	char high[BT_MAX_KEY];                 // And of the upper one (BETWEEN)
+
+	// IN_LIST: normalized keys, in order, and the one being scanned
+	char *list;
+	int list_count, list_next;
+
+	int current_block;                     // 0 if there is no tree
 	int next_entry;
+	int step;                              // 1, or -1 walking left (DESCENDING)
 	int end_block;
 	int end_entry;
+	struct bt_posting_cursor posting;      // Into the list of next_entry
+
+	/* current_block, pinned in page while leaf is set. The values returned
+	 * point into it until the scan moves on to the next leaf */
+	PF_Page *page;                         // Made once per slot of the pool
+	BT_Leaf *leaf;
+
+	/* Leaves crossed in a row through next_block, leaves down the chain
+	 * already read in, and how many to read in at a time */
+	int run, prefetched, window;
+
+	/* Memtable records [mem_next, mem_end) are merged in, but for
+	 * [mem_skip, mem_resume) (equal keys, for NOT_EQUAL) */
+	int mem_next, mem_end;
+	int mem_skip, mem_resume;
+
+	// The next record of the tree, read ahead to be merged
+	int ahead, tree_eof;
+	char ahead_key[BT_MAX_KEY];
+	void *ahead_value;
 };
 
 static struct open_scans {
 	unsigned int count;
-	struct scan_entry *entry[MAX_SCANS];
+	struct scan_entry *entry[MAX_SCANS];   // Into pool, NULL if free
+	struct scan_entry pool[MAX_SCANS];
 } open_scans;
 
 int AM_errno = AME_OK;
 
+// Memtable (further down)
+static int memtable_insert(struct file_entry *file, void *key, void *value2);
+static int memtable_merge(struct file_entry *file);
+static int memtable_bound(struct file_entry *file, void *value, int upper);
+
 // AM functions relating to the file and scan arrays
 static int valid_fd(int fileDesc)
 {
@@ -67,9 +107,67 @@ static int valid_scand(int scanDesc)
 	return 1;
 }
 
+/* Work area and page handles of an open file, made once so that the calls on
+ * it don't allocate */
+static void free_file_buffers(struct file_entry *file)
+{
+	PF_Page **pages[] = { &file->search_page, &file->split_page,
+	                      &file->parent_page, &file->child_page,
+	                      &file->sibling_page, &file->posting_page,
+	                      &file->posting_other };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(pages) / sizeof(*pages); ++i) {
+		if (*pages[i]) {
+			PF_Page_Destroy(pages[i]);
+		}
+	}
+
+	free(file->scratch);
+	free(file->posting_scratch);
+	file->scratch = NULL;
+	file->posting_scratch = NULL;
+
+	free(file->memtable_keys);
+	free(file->memtable_values);
+	file->memtable_keys = NULL;
+	file->memtable_values = NULL;
+	file->memtable_size = 0;
+}
+
+// Returns 0 if out of memory, with whatever was made freed
+static int file_buffers(struct file_entry *file)
+{
+	file->scratch = malloc(file->header.page_size);
+	file->posting_scratch = malloc(file->header.page_size);
+
+	file->memtable_keys = NULL;
+	file->memtable_values = NULL;
+	file->memtable_count = 0;
+	file->memtable_size = 0;
+
+	PF_Page_Init(&file->search_page);
+	PF_Page_Init(&file->split_page);
+	PF_Page_Init(&file->parent_page);
+	PF_Page_Init(&file->child_page);
+	PF_Page_Init(&file->sibling_page);
+	PF_Page_Init(&file->posting_page);
+	PF_Page_Init(&file->posting_other);
+
+	if (file->scratch && file->posting_scratch && file->search_page &&
+	    file->split_page && file->parent_page && file->child_page &&
+	    file->sibling_page && file->posting_page && file->posting_other) {
+		return 1;
+	}
+
+	free_file_buffers(file);
+
+	return 0;
+}
+
 static int scan_done(struct scan_entry *scan) {
 	return (scan->current_block == scan->end_block &&
-	        scan->next_entry > scan->end_entry);
+	        (scan->next_entry - scan->end_entry) * scan->step > 0);
 }
 
 void AM_Init()
@@ -81,22 +179,35 @@ int AM_CreateIndex(char *fileName,
                    char attrType1,
                    int attrLength1,
                    char attrType2,
-                   int attrLength2)
+                   int attrLength2,
+                   int pageSize)
 {
-	BF_Block *bl;
+	PF_File pf;
+	PF_Page *page;
 	BT_Header *header;
 	int fd;
 
+	if (!pageSize) {
+		pageSize = BF_BLOCK_SIZE;
+	}
+
+	if (!PF_ValidPageSize(pageSize)) {
+		AM_errno = AME_INVALID_PAGE_SIZE;
+		return AME_ERROR;
+	}
+
 	CALL_BF(BF_CreateFile(fileName));            // Will fail if file exists
 
-	BF_Block_Init(&bl);
+	PF_Page_Init(&page);
 	CALL_BF(BF_OpenFile(fileName, &fd));         // Time to intitialize file
+	CALL_BF(PF_OpenFile(&pf, fd, pageSize));
 
-	// HEADER SETUP
-	CALL_BF(BF_AllocateBlock(fd, bl));
-	header = (BT_Header *) BF_Block_GetData(bl);
+	// HEADER SETUP (page 0)
+	CALL_BF(PF_AllocatePage(&pf, page));
+	header = (BT_Header *) PF_Page_GetData(page);
 
 	strcpy(header->identifier, BT_IDENTIFIER);
+	header->page_size = pageSize;
 
 	// Make sure the attribute length is correct for numeric machine types
 	switch (attrType1) {
@@ -121,11 +232,12 @@ int AM_CreateIndex(char *fileName,
 	header->field_type[1] = attrType2;
 	header->field_length[1] = attrLength2;
 
-	BF_Block_SetDirty(bl);
-	CALL_BF(BF_UnpinBlock(bl));
+	PF_Page_SetDirty(page);
+	CALL_BF(PF_UnpinPage(page));
 
+	CALL_BF(PF_CloseFile(&pf));
 	CALL_BF(BF_CloseFile(fd));
-	BF_Block_Destroy(&bl);
+	PF_Page_Destroy(&page);
 
 	return AME_OK;
 }
@@ -203,11 +315,24 @@ int AM_OpenIndex(char *fileName)
 			AM_errno = AME_MALLOC_FAILED;
 			i = AME_ERROR;
 		} else {
-			file->fd = fd;
 			file->header = *header;
 			strncpy(file->name, fileName, sizeof(file->name));
 
-			open_files.count++;
+			CALL_BF(PF_OpenFile(&file->pf, fd, file->header.page_size));
+			bt_layout(file);
+			file->finger = 0;
+			memset(file->history, 0, sizeof(file->history));
+			file->read_ahead = READ_AHEAD_MIN;
+
+			if (!file_buffers(file)) {
+				AM_errno = AME_MALLOC_FAILED;
+				PF_CloseFile(&file->pf);
+				free(file);
+				open_files.entry[i] = NULL;
+				i = AME_ERROR;
+			} else {
+				open_files.count++;
+			}
 		}
 
 		CALL_BF(BF_UnpinBlock(bl));
@@ -220,9 +345,10 @@ int AM_OpenIndex(char *fileName)
 
 int AM_CloseIndex(int fileDesc)
 {
-	BF_Block *bl;
+	struct file_entry *file;
+	PF_Page *page;
 	BT_Header *header;
-	int i, fd;
+	int i;
 
 	if (!valid_fd(fileDesc)) {
 		AM_errno = AME_INVALID_FD;
@@ -241,24 +367,26 @@ int AM_CloseIndex(int fileDesc)
 		}
 	}
 
-	fd = open_files.entry[fileDesc]->fd;
-
-	BF_Block_Init(&bl);
+	file = open_files.entry[fileDesc];
+	page = file->child_page;
 
-	// Write back header
-	CALL_BF(BF_GetBlock(fd, 0, bl));
-	header = (BT_Header *) BF_Block_GetData(bl);
+	if (memtable_merge(file) != AME_OK) {
+		return AME_ERROR;
+	}
 
 	// Write back header from file_entry
-	*header = open_files.entry[fileDesc]->header;
+	CALL_BF(PF_GetPage(&file->pf, 0, page));
+	header = (BT_Header *) PF_Page_GetData(page);
 
-	BF_Block_SetDirty(bl);
-	CALL_BF(BF_UnpinBlock(bl));
+	*header = file->header;
 
-	BF_Block_Destroy(&bl);
+	PF_Page_SetDirty(page);
+	CALL_BF(PF_UnpinPage(page));
 
-	CALL_BF(BF_CloseFile(fd));
+	CALL_BF(PF_CloseFile(&file->pf));
+	CALL_BF(BF_CloseFile(file->pf.fd));
 
+	free_file_buffers(file);
 	free(open_files.entry[fileDesc]);
 	open_files.entry[fileDesc] = NULL;
 
@@ -267,15 +395,11 @@ int AM_CloseIndex(int fileDesc)
 	return AME_OK;
 }
 
-int AM_InsertEntry(int fileDesc, void *value1, void *value2)
+/* Options are kept in the cached header, so they are written back (and
+ * persist) with it on AM_CloseIndex */
+int AM_SetIndexOption(int fileDesc, int option, int value)
 {
 	struct file_entry *file;
-	BF_Block *parent, *child;          // For modifyng both parent and child
-	BT_Node *node;
-	BT_Leaf *leaf;
-	struct stack_node *stack;            // list of nodes visited until leaf
-	char *key_up, *key_from_below;
-	int fd, pos, temp, key_size, pointer_up, pointer_from_below;
 
 	if (!valid_fd(fileDesc)) {
 		AM_errno = AME_INVALID_FD;
@@ -283,388 +407,3546 @@ int AM_InsertEntry(int fileDesc, void *value1, void *value2)
 	}
 
 	file = open_files.entry[fileDesc];
-	fd = file->fd;
-	key_size = file->header.field_length[0];
 
-	BF_Block_Init(&parent);
-	BF_Block_Init(&child);
+	switch (option) {
+	case AM_OPT_INTERPOLATION_SEARCH:
+		// Only numeric keys can be interpolated
+		if (value && file->header.field_type[0] == 'c') {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-	// Handle first insertion (No root exists)
-	if (!file->header.root) {
-		CALL_BF(BF_GetBlockCounter(fd, &file->header.root));
+		if (value) {
+			file->header.flags |= BT_INTERPOLATION_SEARCH;
+		} else {
+			file->header.flags &= ~BT_INTERPOLATION_SEARCH;
+		}
+		break;
+	case AM_OPT_SPLIT_LAYOUT:
+		/* Numeric keys only. Blocks already written in the other layout
+		 * can't be read, so the index must still be empty */
+		if ((value && file->header.field_type[0] == 'c') ||
+		    (value && file->header.flags & BT_POSTING_LISTS) ||
+		    file->header.root) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		// Allocate space for new root
-		CALL_BF(BF_AllocateBlock(fd, parent));
-		node = (BT_Node *) BF_Block_GetData(parent);
+		if (value) {
+			file->header.flags |= BT_SPLIT_LAYOUT;
+		} else {
+			file->header.flags &= ~BT_SPLIT_LAYOUT;
+		}
+
+		bt_layout(file);
+		break;
+	case AM_OPT_PREFIX_COMPRESSION:
+		/* String keys only, on an empty index, like the split layout.
+		 * The block must take at least a couple of keys uncompressed */
+		if ((value && file->header.field_type[0] != 'c') ||
+		    (value && file->header.flags & (BT_MESSAGE_BUFFERS |
+		                                    BT_REDISTRIBUTE |
+		                                    BT_POSTING_LISTS |
+		                                    BT_TOP_DOWN)) ||
+		    file->header.root) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		// Left child (pointer 0, head of data block list)
-		CALL_BF(BF_GetBlockCounter(fd, &temp));
-		*pointer(file, node, 0) = temp;
-		file->header.data_head = temp;
+		if (value) {
+			file->header.flags |= BT_PREFIX_COMPRESSION;
+		} else {
+			file->header.flags &= ~BT_PREFIX_COMPRESSION;
+		}
 
-		leaf = create_leaf(fd, &child);
+		bt_layout(file);
 
-		// Right child (next_block of left child, tail of data block list)
-		CALL_BF(BF_GetBlockCounter(fd, &temp));
-		leaf->next_block = temp;
-		file->header.data_tail = temp;
+		if (file->max_keys < 2 || file->max_records < 2) {
+			file->header.flags &= ~BT_PREFIX_COMPRESSION;
+			bt_layout(file);
 
-		BF_Block_SetDirty(child);
-		CALL_BF(BF_UnpinBlock(child));
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
+		break;
+	case AM_OPT_MESSAGE_BUFFERS:
+		/* On an empty index, as nodes change layout. Packed nodes have
+		 * no fixed place for a buffer */
+		if ((value && file->header.flags & (BT_PREFIX_COMPRESSION |
+		                                    BT_UNIQUE |
+		                                    BT_TOP_DOWN)) ||
+		    file->header.root) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		// Insert right child (key, pointer) at root
-		insert_node_nonfull(file, node, value1, temp);
+		if (value) {
+			file->header.flags |= BT_MESSAGE_BUFFERS;
+		} else {
+			file->header.flags &= ~BT_MESSAGE_BUFFERS;
+		}
 
-		leaf = create_leaf(fd, &child);
+		bt_layout(file);
 
-		// Insert record at right child
-		insert_leaf_nonfull(file, leaf, value1, value2);
+		if (value && file->max_messages < 2) {
+			file->header.flags &= ~BT_MESSAGE_BUFFERS;
+			bt_layout(file);
 
-		BF_Block_SetDirty(child);
-		CALL_BF(BF_UnpinBlock(child));
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
+		break;
+	case AM_OPT_REDISTRIBUTE:
+		/* Any time, the blocks stay as they are. Packed leaves would
+		 * have to be repacked to share */
+		if (value && file->header.flags & (BT_PREFIX_COMPRESSION |
+		                                   BT_TOP_DOWN)) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		BF_Block_SetDirty(parent);
-		CALL_BF(BF_UnpinBlock(parent));
+		if (value) {
+			file->header.flags |= BT_REDISTRIBUTE;
+		} else {
+			file->header.flags &= ~BT_REDISTRIBUTE;
+		}
+		break;
+	case AM_OPT_UNIQUE:
+		/* On an empty index, with nothing to check. Records waiting in
+		 * buffers or in a memtable would have to be looked up in the
+		 * tree on each insert, which they are there to avoid */
+		if ((value && (file->header.flags & (BT_MESSAGE_BUFFERS |
+		                                     BT_POSTING_LISTS) ||
+		               file->memtable_size)) ||
+		    file->header.root) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		BF_Block_Destroy(&child);
-		BF_Block_Destroy(&parent);
+		if (value) {
+			file->header.flags |= BT_UNIQUE;
+		} else {
+			file->header.flags &= ~BT_UNIQUE;
+		}
+		break;
+	case AM_OPT_POSTING_LISTS:
+		/* On an empty index, as leaf records grow a tag. Lists hold
+		 * values, which the split layout and packed leaves place apart
+		 * from their keys. Of no use with unique keys */
+		if ((value && file->header.flags & (BT_SPLIT_LAYOUT |
+		                                    BT_PREFIX_COMPRESSION |
+		                                    BT_UNIQUE)) ||
+		    file->header.root) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		return AME_OK;
-	}
+		if (value) {
+			file->header.flags |= BT_POSTING_LISTS;
+		} else {
+			file->header.flags &= ~BT_POSTING_LISTS;
+		}
 
-	key_up = malloc(key_size);
-	key_from_below = malloc(key_size);
-	if (!key_up || !key_from_below) {
-		AM_errno = AME_MALLOC_FAILED;
-		return AME_ERROR;
-	}
+		bt_layout(file);
+		break;
+	case AM_OPT_TOP_DOWN:
+		/* Any time, the blocks stay as they are. A node must have room
+		 * for the key a split below sends up before it is known: how
+		 * much a packed node needs depends on the key. Buffered inserts
+		 * don't go down the tree, and B* shares go back to the parent */
+		if (value && file->header.flags & (BT_PREFIX_COMPRESSION |
+		                                   BT_MESSAGE_BUFFERS |
+		                                   BT_REDISTRIBUTE)) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-	/* Normal operation. A tree exists already.
-	 * Find leaf where the record should go.
-	 * Save visited ancestors for use in possible recursive splits */
-	pos = bt_search(file, value1, &stack);
+		if (value) {
+			file->header.flags |= BT_TOP_DOWN;
+		} else {
+			file->header.flags &= ~BT_TOP_DOWN;
+		}
+		break;
+	case AM_OPT_FILL_FACTOR:
+		// Any time, for the splits from then on
+		if (value < 0 || value > 100) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-	CALL_BF(BF_GetBlock(fd, pos, child));
-	leaf = (BT_Leaf *) BF_Block_GetData(child);
+		file->header.fill_factor = value;
+		break;
+	case AM_OPT_ADAPTIVE_SPLIT:
+		/* Any time. What the inserts were like is only followed while
+		 * the index is open */
+		if (value) {
+			file->header.flags |= BT_ADAPTIVE_SPLIT;
+		} else {
+			file->header.flags &= ~BT_ADAPTIVE_SPLIT;
+		}
 
-	/* If the new record fits in the leaf block, all is well,
-	 * otherwise we have to split the block */
-	if (!leaf_full(file, leaf)) {
-		insert_leaf_nonfull(file, leaf, value1, value2);
+		memset(file->history, 0, sizeof(file->history));
+		break;
+	case AM_OPT_MEMTABLE:
+		/* Not kept in the header: for this open only. What the
+		 * memtable holds goes into the tree before it is resized */
+		if (value < 0 || (value && file->header.flags & BT_UNIQUE)) {
+			AM_errno = AME_INVALID_OPTION;
+			return AME_ERROR;
+		}
 
-		BF_Block_SetDirty(child);
-		CALL_BF(BF_UnpinBlock(child));
-	} else {
-		/* The split gives us the (key, pointer) pair to
-		 * refer to the new leaf block */
-		pointer_up = split_leaf(file, leaf, key_up);
+		if (memtable_merge(file) != AME_OK) {
+			return AME_ERROR;
+		}
 
-		// Find if record has to go to the new leaf now (on the right)
-		if (compare_key(file, key_up, value1) <= 0) {
-			BF_Block_SetDirty(child);
-			CALL_BF(BF_UnpinBlock(child));
+		free(file->memtable_keys);
+		free(file->memtable_values);
+		file->memtable_keys = NULL;
+		file->memtable_values = NULL;
+		file->memtable_size = 0;
 
-			// Get the right leaf (pointer_up)
-			CALL_BF(BF_GetBlock(fd, pointer_up, child));
-			leaf = (BT_Leaf *) BF_Block_GetData(child);
+		if (!value) {
+			break;
 		}
 
-		insert_leaf_nonfull(file, leaf, value1, value2);
+		file->memtable_keys = malloc((size_t) value * file->key_size);
+		file->memtable_values = malloc((size_t) value * file->value_size);
+		if (!file->memtable_keys || !file->memtable_values) {
+			free(file->memtable_keys);
+			free(file->memtable_values);
+			file->memtable_keys = NULL;
+			file->memtable_values = NULL;
 
-		BF_Block_SetDirty(child);
-		CALL_BF(BF_UnpinBlock(child));
+			AM_errno = AME_MALLOC_FAILED;
+			return AME_ERROR;
+		}
 
-		// Move (key, pointer) pairs up the index recursively
-		while ((pos = stack_pop(&stack))) {
-			CALL_BF(BF_GetBlock(fd, pos, parent));
-			node = (BT_Node *) BF_Block_GetData(parent);
+		file->memtable_size = value;
+		break;
+	default:
+		AM_errno = AME_INVALID_OPTION;
+		return AME_ERROR;
+	}
 
-			/* If the new (key, pointer) fits in the node, all is
-			 * well, otherwise we have to split the node */
-			if (!node_full(file, node)) {
-				insert_node_nonfull(file, node, key_up, pointer_up);
+	return AME_OK;
+}
 
-				BF_Block_SetDirty(parent);
-				CALL_BF(BF_UnpinBlock(parent));
+/* B* insert (BT_REDISTRIBUTE) of a record that doesn't fit in its leaf, pinned
+ * in child and found through <stack>. A sibling under the same parent takes
+ * some of the records, the right one if it can, or else the left. If neither
+ * can, the leaf and a sibling split into three. Returns 1 with the record in,
+ * 2 with the record in and (key_up, pointer_up) a new leaf for the parent,
+ * right of *left_up, or 0, with nothing changed, if none of these can be done */
+static int share_insert(struct file_entry *file, struct stack *stack, void *key,
+                        void *value2, char *key_up, int *pointer_up,
+                        int *left_up)
+{
+	PF_Page *parent = file->parent_page, *child = file->child_page;
+	PF_Page *sibling = file->sibling_page, *target;
+	BT_Node *node;
+	BT_Leaf *leaf = (BT_Leaf *) PF_Page_GetData(child), *other, *left, *right;
+	char last[BT_MAX_KEY], sep[BT_MAX_KEY];
+	int i, j, side, shared = 0;
+
+	/* Appends past the end of the data list leave the leaf full instead
+	 * (see split_leaf) */
+	leaf_key(file, leaf, leaf->record_count - 1, last);
+	if (!stack->count ||
+	    (!leaf->next_block && compare_key(file, last, key) < 0)) {
+		return 0;
+	}
 
-				break;                          // "All is well"
-			}
+	CALL_BF(PF_GetPage(&file->pf, stack->data[stack->count - 1], parent));
+	node = (BT_Node *) PF_Page_GetData(parent);
 
-			/* The pair (key_from_below, pointer_from_below)
-			 * has to be inserted at this level.
-			 * -> Temp variables because of new split */
-			memcpy(key_from_below, key_up, key_size);
-			pointer_from_below = pointer_up;
+	// A root emptied by deletes may be left with a single leaf
+	if (!node->key_count) {
+		CALL_BF(PF_UnpinPage(parent));
+		return 0;
+	}
 
-			pointer_up = split_node(file, node, key_up);
+	// Child i is the leaf, j a sibling. Key min(i, j) separates the two
+	i = node_find(file, node, key);
 
-			// Find if (key, pointer) has to go to the right, now.
-			if (compare_key(file, key_up, key_from_below) <= 0) {
-				BF_Block_SetDirty(parent);
-				CALL_BF(BF_UnpinBlock(parent));
+	for (side = 0; side < 2 && !shared; ++side) {
+		j = side ? i - 1 : i + 1;         // Right sibling, then left
+		if (j < 0 || j > node->key_count) {
+			continue;
+		}
 
-				// Get the right node (pointer_up)
-				CALL_BF(BF_GetBlock(fd, pointer_up, parent));
-				node = (BT_Node *) BF_Block_GetData(parent);
-			}
+		CALL_BF(PF_GetPage(&file->pf, *pointer(file, node, j), sibling));
+		other = (BT_Leaf *) PF_Page_GetData(sibling);
 
-			insert_node_nonfull(file, node,
-			                    key_from_below,
-			                    pointer_from_below);
+		left = j > i ? leaf : other;
+		right = j > i ? other : leaf;
 
-			BF_Block_SetDirty(parent);
-			CALL_BF(BF_UnpinBlock(parent));
+		if (!(shared = share_leaves(file, left, right, key, sep))) {
+			CALL_BF(PF_UnpinPage(sibling));
 		}
+	}
 
-		/* If <pos> (popped from the stack) is 0, that means the root
-		 * has split into 2 nodes. Create a new root. */
-		if (!pos) {
-			temp = file->header.root;
-			CALL_BF(BF_GetBlockCounter(fd, &file->header.root));
+	if (shared) {
+		set_key(file, node, j < i ? j : i, sep);
+		target = compare_key(file, sep, key) <= 0 ? sibling : child;
 
-			// Create root with previous root as left
-			CALL_BF(BF_AllocateBlock(fd, parent));
-			node = (BT_Node *) BF_Block_GetData(parent);
+		if (j < i) {
+			target = target == sibling ? child : sibling;
+		}
+	} else {
+		// Both full (or too full): with the right sibling, if there is one
+		j = i < node->key_count ? i + 1 : i - 1;
 
-			*pointer(file, node, 0) = temp;
-			insert_node_nonfull(file, node, key_up, pointer_up);
+		CALL_BF(PF_GetPage(&file->pf, *pointer(file, node, j), sibling));
+		other = (BT_Leaf *) PF_Page_GetData(sibling);
+
+		left = j > i ? leaf : other;
+		right = j > i ? other : leaf;
+
+		*pointer_up = split_leaves(file, left, right, key, key_up, sep);
+		if (!*pointer_up) {
+			CALL_BF(PF_UnpinPage(sibling));
+			CALL_BF(PF_UnpinPage(parent));
+			return 0;
+		}
 
-			BF_Block_SetDirty(parent);
-			CALL_BF(BF_UnpinBlock(parent));
+		/* The pair's separator moves to the right of the new leaf. The
+		 * caller adds the one on its left */
+		set_key(file, node, j < i ? j : i, sep);
+		*left_up = *pointer(file, node, j < i ? j : i);
+		shared = 2;
+
+		if (compare_key(file, key_up, key) > 0) {
+			target = j > i ? child : sibling;
+		} else if (compare_key(file, sep, key) <= 0) {
+			target = j > i ? sibling : child;
+		} else {
+			target = file->split_page;
+			CALL_BF(PF_GetPage(&file->pf, *pointer_up, target));
 		}
 	}
 
-	stack_destroy(&stack);
-	free(key_up);
-	free(key_from_below);
+	insert_leaf_nonfull(file, (BT_Leaf *) PF_Page_GetData(target), key, value2);
 
-	BF_Block_Destroy(&child);
-	BF_Block_Destroy(&parent);
+	// The finger's bounds have moved
+	file->finger = 0;
 
-	return AME_OK;
+	if (target == file->split_page) {
+		PF_Page_SetDirty(target);
+		CALL_BF(PF_UnpinPage(target));
+	}
+
+	PF_Page_SetDirty(child);
+	CALL_BF(PF_UnpinPage(child));
+	PF_Page_SetDirty(sibling);
+	CALL_BF(PF_UnpinPage(sibling));
+	PF_Page_SetDirty(parent);
+	CALL_BF(PF_UnpinPage(parent));
+
+	return shared;
 }
 
-int AM_OpenIndexScan(int fileDesc, int op, void *value)
+// Unique keys (BT_UNIQUE): is <key> in the leaf?
+static int leaf_has_key(struct file_entry *file, BT_Leaf *leaf, void *key)
 {
-	struct scan_entry *scan;
-	struct file_entry *file;
-	BF_Block *bl;
-	BT_Leaf *leaf;
-	int i;
+	char last[BT_MAX_KEY];
+	int i = leaf_find_last(file, leaf, key);
 
-	if (!valid_fd(fileDesc)) {
-		AM_errno = AME_INVALID_FD;
-		return AME_ERROR;
+	if (i < 0) {
+		return 0;
 	}
 
-	file = open_files.entry[fileDesc];
-
-	if (open_scans.count == MAX_SCANS) {
-		AM_errno = AME_MAX_SCANS;
-		return AME_ERROR;
-	}
+	leaf_key(file, leaf, i, last);
 
-	// Find first NULL (unoccupied) scan entry index.
-	i = 0;
-	while (open_scans.entry[i]) {
-		i++;
-	}
+	return !compare_key(file, last, key);
+}
 
-	open_scans.entry[i] = malloc(sizeof(struct scan_entry));
-	scan = open_scans.entry[i];
+/* A unique index has <key> already, in the leaf pinned in child. AM_Upsert
+ * (<replace>) gives the record value <value2>, anything else fails */
+static int unique_clash(struct file_entry *file, void *key, void *value2,
+                        int replace)
+{
+	PF_Page *child = file->child_page;
+	BT_Leaf *leaf = (BT_Leaf *) PF_Page_GetData(child);
 
-	if (!scan) {
-		AM_errno = AME_MALLOC_FAILED;
+	if (!replace) {
+		CALL_BF(PF_UnpinPage(child));
+		AM_errno = AME_DUPLICATE_KEY;
 		return AME_ERROR;
 	}
 
-	scan->fileDesc = fileDesc;
-	scan->op = op;
-	scan->value = value;
+	memcpy(record(file, leaf, leaf_find_last(file, leaf, key), 1), value2,
+	       file->value_size);
 
-	open_scans.count++;
+	PF_Page_SetDirty(child);
+	CALL_BF(PF_UnpinPage(child));
 
-	BF_Block_Init(&bl);
+	return AME_OK;
+}
 
-	// Define the start (block, entry) and the end (block, entry) for each op.
-	switch (op) {
-	case EQUAL:         // For EQUAL operation, only search within one block
-		scan->current_block = bt_search(file, value, NULL);
-		scan->end_block = scan->current_block;
+/* Top-down inserts (BT_TOP_DOWN)
+ * A full node is split on the way down, before anything has to go into it, so
+ * the node above always has room for the key a split sends up. Each level is
+ * read once, while the one above is still pinned, and nothing goes back up the
+ * tree afterwards: no stack of ancestors, no chain of splits from the leaf to
+ * the root. Nodes split a little before they have to */
 
-		CALL_BF(BF_GetBlock(file->fd, scan->current_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+// The child pinned in child_page becomes the parent of the next level down
+static void descend(struct file_entry *file)
+{
+	PF_Page *page = file->parent_page;
 
-		scan->next_entry = leaf_find_first(file, leaf, value);
-		scan->end_entry = leaf_find_last(file, leaf, value);
+	file->parent_page = file->child_page;
+	file->child_page = page;
+}
 
-		CALL_BF(BF_UnpinBlock(bl));
-		break;
-	case NOT_EQUAL: // More on the overlap
-	case LESS_THAN:
-		/* For LESS_THAN(_OR_EQUAL) op, search from the data list head
-		 * until the leaf where <value> is found */
-		scan->current_block = file->header.data_head;
-		scan->next_entry = 0;
+// Side of a split that <key> goes to: the finger's bounds follow it
+static int split_side(struct file_entry *file, void *key_up, void *key)
+{
+	struct bt_bounds *bounds = &file->finger_bounds;
 
-		scan->end_block = bt_search(file, value, NULL);
+	if (compare_key(file, key_up, key) <= 0) {
+		memcpy(bounds->low, key_up, file->key_size);
+		bounds->has_low = 1;
+		return 1;
+	}
 
-		CALL_BF(BF_GetBlock(file->fd, scan->end_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+	memcpy(bounds->high, key_up, file->key_size);
+	bounds->has_high = 1;
+	return 0;
+}
 
-		scan->end_entry = leaf_find_first(file, leaf, value) - 1;
-		CALL_BF(BF_UnpinBlock(bl));
-		break;
-	case GREATER_THAN:
-		/* For GREATER_THAN(_OR_EQUAL) op, search from the leaf where
-		 * <value> is found until the data list tail */
-		scan->current_block = bt_search(file, value, NULL);
+// insert_record() for BT_TOP_DOWN, past the finger
+static int insert_top_down(struct file_entry *file, void *key, void *value2,
+                           int replace)
+{
+	struct bt_bounds *bounds = &file->finger_bounds;
+	BT_Node *node, *below;
+	BT_Leaf *leaf;
+	char key_up[BT_MAX_KEY];
+	int pos, i, pointer_up;
 
-		CALL_BF(BF_GetBlock(file->fd, scan->current_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+	bounds->has_low = 0;
+	bounds->has_high = 0;
 
-		scan->next_entry = leaf_find_last(file, leaf, value) + 1;
-		CALL_BF(BF_UnpinBlock(bl));
+	CALL_BF(PF_GetPage(&file->pf, file->header.root, file->parent_page));
+	node = (BT_Node *) PF_Page_GetData(file->parent_page);
 
-		scan->end_block = file->header.data_tail;
+	// A full root splits first, under a new one
+	if (node_full(file, node, key)) {
+		pointer_up = split_node(file, node, key, key_up);
 
-		CALL_BF(BF_GetBlock(file->fd, scan->end_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+		PF_Page_SetDirty(file->parent_page);
+		CALL_BF(PF_UnpinPage(file->parent_page));
 
-		scan->end_entry = leaf->record_count - 1;
-		CALL_BF(BF_UnpinBlock(bl));
-		break;
-	case LESS_THAN_OR_EQUAL:
-		scan->current_block = file->header.data_head;
-		scan->next_entry = 0;
+		pos = file->header.root;
+		CALL_BF(bt_allocate(file, file->parent_page, &file->header.root));
+		node = (BT_Node *) PF_Page_GetData(file->parent_page);
 
-		scan->end_block = bt_search(file, value, NULL);
+		*pointer(file, node, 0) = pos;
+		insert_node_nonfull(file, node, key_up, pointer_up);
 
-		CALL_BF(BF_GetBlock(file->fd, scan->end_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+		PF_Page_SetDirty(file->parent_page);
+	}
 
-		scan->end_entry = leaf_find_last(file, leaf, value);
-		CALL_BF(BF_UnpinBlock(bl));
-		break;
-	case GREATER_THAN_OR_EQUAL:
-		scan->current_block = bt_search(file, value, NULL);
+	/* <node> (in parent_page) has room for one more key. Make sure the
+	 * child the record goes down to has too */
+	for (;;) {
+		i = node_find(file, node, key);
 
-		CALL_BF(BF_GetBlock(file->fd, scan->current_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+		if (i > 0) {
+			node_key(file, node, i - 1, bounds->low);
+			bounds->has_low = 1;
+		}
 
-		scan->next_entry = leaf_find_first(file, leaf, value);
-		CALL_BF(BF_UnpinBlock(bl));
+		if (i < node->key_count) {
+			node_key(file, node, i, bounds->high);
+			bounds->has_high = 1;
+		}
 
-		scan->end_block = file->header.data_tail;
+		pos = *pointer(file, node, i);
+		CALL_BF(PF_GetPage(&file->pf, pos, file->child_page));
+		below = (BT_Node *) PF_Page_GetData(file->child_page);
 
-		CALL_BF(BF_GetBlock(file->fd, scan->end_block, bl));
-		leaf = (BT_Leaf *) BF_Block_GetData(bl);
+		if (below->is_leaf) {
+			break;
+		}
 
-		scan->end_entry = leaf->record_count - 1;
-		CALL_BF(BF_UnpinBlock(bl));
-		break;
-	default:
-		// Invalid operation. Terminate scan
-		free(scan);
-		open_scans.entry[i] = NULL;
-		open_scans.count--;
+		if (node_full(file, below, key)) {
+			pointer_up = split_node(file, below, key, key_up);
+			insert_node_after(file, node, pos, key_up, pointer_up);
 
-		AM_errno = AME_INVALID_OP;
-		i = AME_ERROR;
-	}
+			PF_Page_SetDirty(file->parent_page);
+			PF_Page_SetDirty(file->child_page);
 
-	BF_Block_Destroy(&bl);
+			// The new node on the right
+			if (split_side(file, key_up, key)) {
+				CALL_BF(PF_UnpinPage(file->child_page));
+				CALL_BF(PF_GetPage(&file->pf, pointer_up,
+				                   file->child_page));
+				below = (BT_Node *) PF_Page_GetData(file->child_page);
+			}
+		}
 
-	return i;
-}
+		CALL_BF(PF_UnpinPage(file->parent_page));
+		descend(file);
+		node = below;
+	}
 
-/* Normally follows the directions (start, end) from OpenInexScan, but has one
- * special case: NOT_EQUAL becomes GREATER_THAN after LESS_THAN. */
-void *AM_FindNextEntry(int scanDesc)
-{
-	struct scan_entry *scan;
-	struct file_entry *file;
-	BF_Block *bl;
-	BT_Leaf *leaf;
-	void *found;
+	leaf = (BT_Leaf *) below;
+	file->finger = pos;
 
-	if (!valid_scand(scanDesc)) {
-		AM_errno = AME_INVALID_SCAND;
-		return NULL;
-	}
+	if (leaf_full(file, leaf, key)) {
+		// No split for a key that is there already
+		if (file->header.flags & BT_UNIQUE && leaf_has_key(file, leaf, key)) {
+			CALL_BF(PF_UnpinPage(file->parent_page));
+			return unique_clash(file, key, value2, replace);
+		}
 
-	scan = open_scans.entry[scanDesc];
-	file = open_files.entry[scan->fileDesc];
+		pointer_up = split_leaf(file, leaf, pos, key, key_up);
+		insert_node_after(file, node, pos, key_up, pointer_up);
 
-	BF_Block_Init(&bl);
+		PF_Page_SetDirty(file->parent_page);
+		PF_Page_SetDirty(file->child_page);
 
-	BF_GetBlock(file->fd, scan->current_block, bl);
-	leaf = (BT_Leaf *) BF_Block_GetData(bl);
+		if (split_side(file, key_up, key)) {
+			CALL_BF(PF_UnpinPage(file->child_page));
+			CALL_BF(PF_GetPage(&file->pf, pointer_up, file->child_page));
+			leaf = (BT_Leaf *) PF_Page_GetData(file->child_page);
 
-	// If scan ends here and is not the special case NOT_EQUAL, we're done.
-	if (scan_done(scan)) {
-		/* NOT_EQUAL initially behaves like LESS_THAN.
-		 * When the LESS_THAN op ends, we'll switch to GREATER_THAN */
-		if (scan->op == NOT_EQUAL) {
-			/* GREATER_THAN:
-			* - start: the first entry >= value in the current block
-			* - end: last entry of last block */
-			scan->op = GREATER_THAN;
+			file->finger = pointer_up;
+		}
+	}
 
-			scan->next_entry = leaf_find_last(file, leaf, scan->value) + 1;
-			BF_UnpinBlock(bl);
+	CALL_BF(PF_UnpinPage(file->parent_page));
 
-			scan->end_block = file->header.data_tail;
+	i = insert_leaf_nonfull(file, leaf, key, value2);
+	if (i < 0) {
+		return unique_clash(file, key, value2, replace);
+	}
 
-			BF_GetBlock(file->fd, scan->end_block, bl);
-			leaf = (BT_Leaf *) BF_Block_GetData(bl);
+	bt_note_insert(file, file->finger, i);
+
+	PF_Page_SetDirty(file->child_page);
+	CALL_BF(PF_UnpinPage(file->child_page));
+
+	return AME_OK;
+}
+
+/* Insert the record with normalized key <key> into its leaf, splitting blocks
+ * up the tree as needed. There must be a root. On a unique index, a record
+ * with the key already there makes it fail, or takes <value2> if <replace> */
+static int insert_record(struct file_entry *file, void *key, void *value2,
+                         int replace)
+{
+	PF_Page *parent, *child;          // For modifyng both parent and child
+	BT_Node *node;
+	BT_Leaf *leaf;
+	struct stack stack;                  // list of nodes visited until leaf
+	char key_up[BT_MAX_KEY], key_from_below[BT_MAX_KEY];
+	PF_File *pf = &file->pf;
+	int pos, temp, key_size = file->key_size, pointer_up = 0, pointer_from_below;
+	int shared, left;
+
+	parent = file->parent_page;
+	child = file->child_page;
+
+	/* A record in the range of the finger goes straight to its leaf, if
+	 * it fits there */
+	pos = 0;
+	stack.count = 0;
+
+	if (file->finger && bt_in_bounds(file, &file->finger_bounds, key)) {
+		CALL_BF(PF_GetPage(pf, file->finger, child));
+		leaf = (BT_Leaf *) PF_Page_GetData(child);
+
+		if (leaf_full(file, leaf, key)) {
+			CALL_BF(PF_UnpinPage(child));
+		} else {
+			pos = file->finger;
+		}
+	}
+
+	if (!pos && file->header.flags & BT_TOP_DOWN) {
+		return insert_top_down(file, key, value2, replace);
+	}
+
+	/* Otherwise find leaf where the record should go.
+	 * Save visited ancestors for use in possible recursive splits */
+	if (!pos) {
+		pos = bt_search_bounded(file, key, &stack, &file->finger_bounds);
+		file->finger = pos;
+
+		CALL_BF(PF_GetPage(pf, pos, child));
+		leaf = (BT_Leaf *) PF_Page_GetData(child);
+	}
+
+	/* If the new record fits in the leaf block, all is well,
+	 * otherwise we have to split the block */
+	if (!leaf_full(file, leaf, key)) {
+		temp = insert_leaf_nonfull(file, leaf, key, value2);
+		if (temp < 0) {
+			return unique_clash(file, key, value2, replace);
+		}
+
+		bt_note_insert(file, pos, temp);
+
+		PF_Page_SetDirty(child);
+		CALL_BF(PF_UnpinPage(child));
+	} else {
+		// No split for a key that is there already
+		if (file->header.flags & BT_UNIQUE && leaf_has_key(file, leaf, key)) {
+			return unique_clash(file, key, value2, replace);
+		}
+
+		/* B*: a sibling takes some of the records, or two full leaves
+		 * split into three */
+		shared = 0;
+		left = pos;
+		if (file->header.flags & BT_REDISTRIBUTE) {
+			shared = share_insert(file, &stack, key, value2,
+			                      key_up, &pointer_up, &left);
+		}
+
+		if (shared == AME_ERROR) {
+			return AME_ERROR;
+		} else if (shared == 1) {
+			return AME_OK;          // Nothing new for the parent
+		}
+
+		if (!shared) {
+			/* The split gives us the (key, pointer) pair to
+			 * refer to the new leaf block */
+			pointer_up = split_leaf(file, leaf, pos, key, key_up);
+
+			/* Find if record has to go to the new leaf now (on
+			 * the right). The finger follows it, with key_up as
+			 * the new bound */
+			if (compare_key(file, key_up, key) <= 0) {
+				PF_Page_SetDirty(child);
+				CALL_BF(PF_UnpinPage(child));
+
+				// Get the right leaf (pointer_up)
+				CALL_BF(PF_GetPage(pf, pointer_up, child));
+				leaf = (BT_Leaf *) PF_Page_GetData(child);
+
+				file->finger = pointer_up;
+				memcpy(file->finger_bounds.low, key_up, key_size);
+				file->finger_bounds.has_low = 1;
+			} else {
+				memcpy(file->finger_bounds.high, key_up, key_size);
+				file->finger_bounds.has_high = 1;
+			}
+
+			temp = insert_leaf_nonfull(file, leaf, key, value2);
+			bt_note_insert(file, file->finger, temp);
+
+			PF_Page_SetDirty(child);
+			CALL_BF(PF_UnpinPage(child));
+		}
+
+		// Move (key, pointer) pairs up the index recursively
+		while ((pos = stack_pop(&stack))) {
+			CALL_BF(PF_GetPage(pf, pos, parent));
+			node = (BT_Node *) PF_Page_GetData(parent);
+
+			/* If the new (key, pointer) fits in the node, all is
+			 * well, otherwise we have to split the node */
+			if (!node_full(file, node, key_up)) {
+				insert_node_after(file, node, left, key_up, pointer_up);
+
+				PF_Page_SetDirty(parent);
+				CALL_BF(PF_UnpinPage(parent));
+
+				break;                          // "All is well"
+			}
+
+			/* The pair (key_from_below, pointer_from_below)
+			 * has to be inserted at this level.
+			 * -> Temp variables because of new split */
+			memcpy(key_from_below, key_up, key_size);
+			pointer_from_below = pointer_up;
+
+			pointer_up = split_node(file, node, key_from_below, key_up);
+
+			/* Find if (key, pointer) has to go to the right, now: next
+			 * to <left>, wherever that went among equal keys */
+			if (compare_key(file, key_up, key_from_below) <= 0 &&
+			    node_child(file, node, left) < 0) {
+				PF_Page_SetDirty(parent);
+				CALL_BF(PF_UnpinPage(parent));
+
+				// Get the right node (pointer_up)
+				CALL_BF(PF_GetPage(pf, pointer_up, parent));
+				node = (BT_Node *) PF_Page_GetData(parent);
+			}
+
+			insert_node_after(file, node, left, key_from_below,
+			                  pointer_from_below);
+
+			PF_Page_SetDirty(parent);
+			CALL_BF(PF_UnpinPage(parent));
+
+			// The pair for the next level up is right of this node
+			left = pos;
+		}
+
+		/* If <pos> (popped from the stack) is 0, that means the root
+		 * has split into 2 nodes. Create a new root. */
+		if (!pos) {
+			temp = file->header.root;
+
+			// Create root with previous root as left
+			CALL_BF(bt_allocate(file, parent, &file->header.root));
+			node = (BT_Node *) PF_Page_GetData(parent);
+
+			*pointer(file, node, 0) = temp;
+			insert_node_nonfull(file, node, key_up, pointer_up);
+
+			PF_Page_SetDirty(parent);
+			CALL_BF(PF_UnpinPage(parent));
+		}
+	}
+
+	return AME_OK;
+}
+
+/* Message buffers (BT_MESSAGE_BUFFERS)
+ * Nodes keep a buffer of records on their way down, in key order. An insert
+ * only adds one to the buffer of the root. A full buffer sends the messages
+ * bound for the child with the most of them down a level at once: into the
+ * buffer of the child or, for a leaf, into the leaf. A random leaf is then
+ * written once for a batch of inserts rather than once for each. Scans first
+ * apply the messages in their range to the leaves */
+
+/* Make room in the buffer of node <pos> (see above). If the child's buffer
+ * has no room for them, it is flushed first */
+static int flush_buffer(struct file_entry *file, int pos)
+{
+	PF_Page *parent = file->parent_page, *child = file->child_page;
+	BT_Node *node, *below;
+	char *records = file->scratch;         // Only prefix compression uses it
+	int i, n, from, to, best, best_from = 0, best_to = 0, target;
+
+	for (;;) {
+		CALL_BF(PF_GetPage(&file->pf, pos, parent));
+		node = (BT_Node *) PF_Page_GetData(parent);
+
+		// The messages for child i are those in [key i - 1, key i)
+		best = -1;
+		from = 0;
+
+		for (i = 0; i <= node->key_count; ++i) {
+			to = i < node->key_count ?
+			     message_bound(file, node, key(file, node, i), 0) :
+			     *message_count(file, node);
+
+			if (to - from > best_to - best_from || best == -1) {
+				best = i;
+				best_from = from;
+				best_to = to;
+			}
+
+			from = to;
+		}
+
+		if (best_from == best_to) {
+			CALL_BF(PF_UnpinPage(parent));
+			return AME_OK;
+		}
+
+		target = *pointer(file, node, best);
+		n = best_to - best_from;
+
+		CALL_BF(PF_GetPage(&file->pf, target, child));
+		below = (BT_Node *) PF_Page_GetData(child);
+
+		// Into the leaf (and whatever splits off it) as records
+		if (below->is_leaf) {
+			memcpy(records, message(file, node, best_from, 0),
+			       n * file->record_size);
+			unbuffer_messages(file, node, best_from, best_to);
+
+			PF_Page_SetDirty(parent);
+			CALL_BF(PF_UnpinPage(parent));
+			CALL_BF(PF_UnpinPage(child));
+
+			for (i = 0; i < n; ++i) {
+				if (insert_record(file, records + i * file->record_size,
+				                  records + i * file->record_size +
+				                  file->key_size, 0) != AME_OK) {
+					return AME_ERROR;
+				}
+			}
+
+			return AME_OK;
+		}
+
+		if (*message_count(file, below) + n <= file->max_messages) {
+			for (i = best_from; i < best_to; ++i) {
+				buffer_message(file, below, message(file, node, i, 0),
+				               message(file, node, i, 1));
+			}
+
+			unbuffer_messages(file, node, best_from, best_to);
+
+			PF_Page_SetDirty(child);
+			CALL_BF(PF_UnpinPage(child));
+			PF_Page_SetDirty(parent);
+			CALL_BF(PF_UnpinPage(parent));
+
+			return AME_OK;
+		}
+
+		/* Make room below first. The child (or this node) may split
+		 * meanwhile, so start over */
+		CALL_BF(PF_UnpinPage(child));
+		CALL_BF(PF_UnpinPage(parent));
+
+		if (flush_buffer(file, target) != AME_OK) {
+			return AME_ERROR;
+		}
+	}
+}
+
+// Buffer a record at the root, flushing its buffer first if full
+static int buffer_insert(struct file_entry *file, void *key, void *value2)
+{
+	PF_Page *bl = file->parent_page;
+	BT_Node *node;
+
+	for (;;) {
+		CALL_BF(PF_GetPage(&file->pf, file->header.root, bl));
+		node = (BT_Node *) PF_Page_GetData(bl);
+
+		if (*message_count(file, node) < file->max_messages) {
+			buffer_message(file, node, key, value2);
+
+			PF_Page_SetDirty(bl);
+			CALL_BF(PF_UnpinPage(bl));
+
+			return AME_OK;
+		}
+
+		CALL_BF(PF_UnpinPage(bl));
+
+		// The root may split, the new one has an empty buffer
+		if (flush_buffer(file, file->header.root) != AME_OK) {
+			return AME_ERROR;
+		}
+	}
+}
+
+// Records taken out of the buffers, for drain_buffers
+struct drained {
+	int count, size;
+	char *records;
+};
+
+static int drained_add(struct drained *drained, int record_size, char *records, int n)
+{
+	char *grown;
+
+	if (drained->count + n > drained->size) {
+		drained->size = 2 * (drained->count + n);
+		grown = realloc(drained->records, (size_t) drained->size * record_size);
+
+		if (!grown) {
+			AM_errno = AME_MALLOC_FAILED;
+			return AME_ERROR;
+		}
+
+		drained->records = grown;
+	}
+
+	memcpy(drained->records + (size_t) drained->count * record_size, records,
+	       (size_t) n * record_size);
+	drained->count += n;
+
+	return AME_OK;
+}
+
+/* Take the messages with keys in [low, high] (NULL: unbounded) out of node
+ * <pos> and the nodes below it. The deepest (oldest) ones come first */
+static int drain_node(struct file_entry *file, int pos, void *low, void *high,
+                      struct drained *drained)
+{
+	PF_Page *bl = file->parent_page;
+	BT_Node *node;
+	int i, count, child, leaves = 0, skip, from, to, result = AME_OK;
+
+	CALL_BF(PF_GetPage(&file->pf, pos, bl));
+	count = ((BT_Node *) PF_Page_GetData(bl))->key_count;
+	child = *pointer(file, (BT_Node *) PF_Page_GetData(bl), 0);
+	CALL_BF(PF_UnpinPage(bl));
+
+	// The tree is balanced: if one child is a leaf, all of them are
+	CALL_BF(PF_GetPage(&file->pf, child, bl));
+	leaves = ((BT_Node *) PF_Page_GetData(bl))->is_leaf;
+	CALL_BF(PF_UnpinPage(bl));
+
+	// Child i takes keys in [key i - 1, key i)
+	for (i = 0; i <= count && !leaves; ++i) {
+		CALL_BF(PF_GetPage(&file->pf, pos, bl));
+		node = (BT_Node *) PF_Page_GetData(bl);
+
+		skip = (i > 0 && high &&
+		        compare_key(file, key(file, node, i - 1), high) > 0) ||
+		       (i < count && low &&
+		        compare_key(file, low, key(file, node, i)) >= 0);
+		child = *pointer(file, node, i);
+
+		CALL_BF(PF_UnpinPage(bl));
+
+		if (!skip && drain_node(file, child, low, high, drained) != AME_OK) {
+			return AME_ERROR;
+		}
+	}
+
+	CALL_BF(PF_GetPage(&file->pf, pos, bl));
+	node = (BT_Node *) PF_Page_GetData(bl);
+
+	from = low ? message_bound(file, node, low, 0) : 0;
+	to = high ? message_bound(file, node, high, 1) : *message_count(file, node);
+
+	if (from < to) {
+		result = drained_add(drained, file->record_size,
+		                     message(file, node, from, 0), to - from);
+	}
+
+	if (from < to && result == AME_OK) {
+		unbuffer_messages(file, node, from, to);
+		PF_Page_SetDirty(bl);
+	}
+
+	CALL_BF(PF_UnpinPage(bl));
+
+	return result;
+}
+
+/* Apply the buffered messages with keys in [low, high] to the leaves, for a
+ * scan of that range to find them there */
+static int drain_buffers(struct file_entry *file, void *low, void *high)
+{
+	struct drained drained = { 0, 0, NULL };
+	char *record;
+	int i, result;
+
+	if (!(file->header.flags & BT_MESSAGE_BUFFERS) || !file->header.root) {
+		return AME_OK;
+	}
+
+	result = drain_node(file, file->header.root, low, high, &drained);
+
+	// Whatever was taken out goes down, even if not all of it could be
+	for (i = 0; i < drained.count; ++i) {
+		record = drained.records + (size_t) i * file->record_size;
+
+		if (insert_record(file, record, record + file->key_size, 0) != AME_OK) {
+			result = AME_ERROR;
+			break;
+		}
+	}
+
+	free(drained.records);
+
+	return result;
+}
+
+/* The first record of an index makes the root and its two leaves. It goes
+ * straight to the tree, memtable or not: callers that hold a batch need a
+ * root to insert the rest under */
+static int plant_root(struct file_entry *file, void *key, void *value2)
+{
+	PF_Page *parent, *child, *sibling;
+	BT_Node *node;
+	BT_Leaf *leaf, *right;
+	int temp;
+
+	parent = file->parent_page;
+	child = file->child_page;
+	sibling = file->sibling_page;
+
+	// Allocate space for new root
+	CALL_BF(bt_allocate(file, parent, &file->header.root));
+	node = (BT_Node *) PF_Page_GetData(parent);
+
+	// Left child (pointer 0, head of data block list)
+	leaf = create_leaf(file, &child, &temp);
+	*pointer(file, node, 0) = temp;
+	file->header.data_head = temp;
+
+	// Right child (next_block of left child, tail of data block list)
+	right = create_leaf(file, &sibling, &temp);
+	leaf->next_block = temp;
+	right->prev_block = file->header.data_head;
+	file->header.data_tail = temp;
+
+	PF_Page_SetDirty(child);
+	CALL_BF(PF_UnpinPage(child));
+
+	// Insert right child (key, pointer) at root
+	insert_node_nonfull(file, node, key, temp);
+
+	// Insert record at right child
+	insert_leaf_nonfull(file, right, key, value2);
+
+	PF_Page_SetDirty(sibling);
+	CALL_BF(PF_UnpinPage(sibling));
+
+	PF_Page_SetDirty(parent);
+	CALL_BF(PF_UnpinPage(parent));
+
+	return AME_OK;
+}
+
+int AM_InsertEntry(int fileDesc, void *value1, void *value2)
+{
+	struct file_entry *file;
+	char key[BT_MAX_KEY];
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+
+	normalize_key(file, key, value1);
+
+	// With a memtable, the record waits there
+	if (file->memtable_size) {
+		return memtable_insert(file, key, value2);
+	}
+
+	// Handle first insertion (No root exists)
+	if (!file->header.root) {
+		return plant_root(file, key, value2);
+	}
+
+	/* Normal operation. A tree exists already.
+	 * Write-optimized indexes take it as a message, for later */
+	if (file->header.flags & BT_MESSAGE_BUFFERS) {
+		return buffer_insert(file, key, value2);
+	}
+
+	return insert_record(file, key, value2, 0);
+}
+
+/* Where the records with key <key> are in the tree: from entry *first of leaf
+ * *first_block (unless first_block is NULL) to entry *last of leaf
+ * *last_block. bt_search finds the last leaf that may hold them. Without
+ * posting lists equal keys can run over several leaves, so if they start that
+ * leaf (or it has lost them) bt_search_first finds the first one. *first is
+ * past the end of its leaf if the run starts on the next one */
+static int key_run(struct file_entry *file, void *key, int *first_block,
+                   int *first, int *last_block, int *last)
+{
+	PF_Page *bl = file->child_page;
+	BT_Leaf *leaf;
+
+	*last_block = bt_search(file, key, NULL);
+
+	CALL_BF(PF_GetPage(&file->pf, *last_block, bl));
+	leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+	*last = leaf_find_last(file, leaf, key);
+
+	if (first_block) {
+		*first_block = *last_block;
+		*first = leaf_find_first(file, leaf, key);
+	}
+
+	CALL_BF(PF_UnpinPage(bl));
+
+	if (!first_block || *first || *last_block == file->header.data_head) {
+		return AME_OK;
+	}
+
+	if (!(*first_block = bt_search_first(file, key))) {
+		AM_errno = AME_BF_ERROR;
+		return AME_ERROR;
+	}
+
+	if (*first_block != *last_block) {
+		CALL_BF(PF_GetPage(&file->pf, *first_block, bl));
+		leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+		*first = leaf_find_first(file, leaf, key);
+		CALL_BF(PF_UnpinPage(bl));
+	}
+
+	return AME_OK;
+}
+
+/* Give the records with key <value1> and second field <old_value2> the second
+ * field <new_value2>, where they are: in the memtable, or in their leaves
+ * (the only blocks written). Buffered records are applied to the leaves first */
+int AM_UpdateEntry(int fileDesc, void *value1, void *old_value2, void *new_value2)
+{
+	struct file_entry *file;
+	PF_Page *child;
+	BT_Leaf *leaf;
+	char key[BT_MAX_KEY], *value;
+	int i, n, head, from, to, pos, last_block, last, next;
+	int updated = 0, dirty;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+	child = file->child_page;
+
+	normalize_key(file, key, value1);
+
+	from = to = 0;
+	if (file->memtable_count) {
+		from = memtable_bound(file, key, 0);
+		to = memtable_bound(file, key, 1);
+	}
+
+	for (i = from; i < to; ++i) {
+		value = file->memtable_values + (size_t) i * file->value_size;
+
+		if (!memcmp(value, old_value2, file->value_size)) {
+			memcpy(value, new_value2, file->value_size);
+			updated++;
+		}
+	}
+
+	if (file->header.root) {
+		if (drain_buffers(file, key, key) != AME_OK) {
+			return AME_ERROR;
+		}
+
+		if (key_run(file, key, &pos, &from, &last_block, &last) != AME_OK) {
+			return AME_ERROR;
+		}
+
+		// Along the leaves of the run, to the last one
+		for (;;) {
+			CALL_BF(PF_GetPage(&file->pf, pos, child));
+			leaf = (BT_Leaf *) PF_Page_GetData(child);
+
+			to = pos == last_block ? last + 1 : leaf->record_count;
+			dirty = 0;
+
+			for (i = from; i < to; ++i) {
+				value = record(file, leaf, i, 1);
+
+				// The values of a posting list stay in order
+				if ((head = leaf_posting(file, leaf, i))) {
+					for (n = posting_remove(file, head, old_value2); n; --n) {
+						posting_insert(file, head, new_value2);
+						updated++;
+					}
+				} else if (!memcmp(value, old_value2, file->value_size)) {
+					memcpy(value, new_value2, file->value_size);
+					dirty = 1;
+					updated++;
+				}
+			}
+
+			if (dirty) {
+				PF_Page_SetDirty(child);
+			}
+
+			next = leaf->next_block;
+			CALL_BF(PF_UnpinPage(child));
+
+			if (pos == last_block) {
+				break;
+			}
+
+			pos = next;
+			from = 0;
+		}
+	}
+
+	if (!updated) {
+		AM_errno = AME_NOT_FOUND;
+		return AME_ERROR;
+	}
+
+	return AME_OK;
+}
+
+/* Unique index: insert the record, or give the one with key <value1> the
+ * second field <value2>, in the same descent */
+int AM_Upsert(int fileDesc, void *value1, void *value2)
+{
+	struct file_entry *file;
+	char key[BT_MAX_KEY];
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+
+	if (!(file->header.flags & BT_UNIQUE)) {
+		AM_errno = AME_NOT_UNIQUE;
+		return AME_ERROR;
+	}
+
+	normalize_key(file, key, value1);
+
+	// Neither memtable nor buffers on a unique index: the tree has it all
+	if (!file->header.root) {
+		return plant_root(file, key, value2);
+	}
+
+	return insert_record(file, key, value2, 1);
+}
+
+/* Batches of records, for AM_BulkLoad and AM_InsertBatch.
+ * Both take the records in key order: normalized copies of the keys are
+ * sorted, unless they come sorted already */
+struct batch {
+	char *value1, *value2;                 // As given
+	int count;
+	char *keys;                            // Normalized copies (if sorted)
+	char **sorted;                         // Into keys, in key order (or NULL)
+	int normalized;                        // value1 is, and sorted (memtable)
+};
+
+// qsort() has no context argument, so the file whose keys it sorts goes here
+static struct file_entry *sort_file;
+
+static int compare_entries(const void *a, const void *b)
+{
+	char *x = *(char * const *) a, *y = *(char * const *) b;
+	int cmp = compare_key(sort_file, x, y);
+
+	// Equal keys keep their input order
+	return cmp ? cmp : (x > y) - (x < y);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	return compare_key(sort_file, (void *) a, (void *) b);
+}
+
+static int batch_sort(struct file_entry *file, struct batch *batch)
+{
+	char a[BT_MAX_KEY], b[BT_MAX_KEY];
+	int i;
+
+	batch->keys = NULL;
+	batch->sorted = NULL;
+
+	for (i = 1; i < batch->count; ++i) {
+		normalize_key(file, a, batch->value1 + (size_t) (i - 1) * file->key_size);
+		normalize_key(file, b, batch->value1 + (size_t) i * file->key_size);
+
+		if (compare_key(file, a, b) > 0) {
+			break;
+		}
+	}
+
+	if (i >= batch->count) {
+		return AME_OK;
+	}
+
+	batch->keys = malloc((size_t) batch->count * file->key_size);
+	batch->sorted = malloc(batch->count * sizeof(*batch->sorted));
+	if (!batch->keys || !batch->sorted) {
+		free(batch->keys);
+		free(batch->sorted);
+		AM_errno = AME_MALLOC_FAILED;
+		return AME_ERROR;
+	}
+
+	for (i = 0; i < batch->count; ++i) {
+		batch->sorted[i] = batch->keys + (size_t) i * file->key_size;
+		normalize_key(file, batch->sorted[i],
+		              batch->value1 + (size_t) i * file->key_size);
+	}
+
+	sort_file = file;
+	qsort(batch->sorted, batch->count, sizeof(*batch->sorted), compare_entries);
+
+	return AME_OK;
+}
+
+/* The i-th record in key order: returns its normalized key (in <buffer>, if
+ * needed) and points <value> to its value */
+static char *batch_record(struct file_entry *file, struct batch *batch, int i,
+                          char *buffer, char **value)
+{
+	char *key = buffer;
+
+	if (batch->sorted) {
+		key = batch->sorted[i];
+		i = (key - batch->keys) / file->key_size;
+	} else if (batch->normalized) {
+		key = batch->value1 + (size_t) i * file->key_size;
+	} else {
+		normalize_key(file, key, batch->value1 + (size_t) i * file->key_size);
+	}
+
+	*value = batch->value2 + (size_t) i * file->value_size;
+
+	return key;
+}
+
+/* Unique keys (BT_UNIQUE): a batch may not repeat a key, nor hold one that is
+ * in the tree already. All of it is checked before a record is written, so a
+ * refused batch leaves the index as it was. The keys come in order, so each
+ * leaf is read once, for all of those within its bounds */
+static int batch_unique(struct file_entry *file, struct batch *batch)
+{
+	struct stack stack;
+	struct bt_bounds bounds;
+	PF_Page *child = file->child_page;
+	BT_Leaf *leaf = NULL;
+	char a[BT_MAX_KEY], b[BT_MAX_KEY], *key, *value;
+	int i, clash = 0;
+
+	if (!(file->header.flags & BT_UNIQUE)) {
+		return AME_OK;
+	}
+
+	for (i = 1; i < batch->count; ++i) {
+		if (!compare_key(file, batch_record(file, batch, i - 1, a, &value),
+		                 batch_record(file, batch, i, b, &value))) {
+			AM_errno = AME_DUPLICATE_KEY;
+			return AME_ERROR;
+		}
+	}
+
+	// Neither memtable nor buffers on a unique index: the tree has it all
+	for (i = 0; i < batch->count && file->header.root && !clash; ++i) {
+		key = batch_record(file, batch, i, a, &value);
+
+		if (!leaf || !bt_in_bounds(file, &bounds, key)) {
+			if (leaf) {
+				CALL_BF(PF_UnpinPage(child));
+			}
+
+			CALL_BF(PF_GetPage(&file->pf,
+			                   bt_search_bounded(file, key, &stack, &bounds),
+			                   child));
+			leaf = (BT_Leaf *) PF_Page_GetData(child);
+		}
+
+		clash = leaf_find_last(file, leaf, key) >= leaf_find_first(file, leaf, key);
+	}
+
+	if (leaf) {
+		CALL_BF(PF_UnpinPage(child));
+	}
+
+	if (clash) {
+		AM_errno = AME_DUPLICATE_KEY;
+		return AME_ERROR;
+	}
+
+	return AME_OK;
+}
+
+static void batch_destroy(struct batch *batch)
+{
+	free(batch->keys);
+	free(batch->sorted);
+}
+
+/* The blocks of a tree level, or of a part of it, in key order: block i holds
+ * the keys from separator i up to separator i + 1 (the first one has none) */
+struct index_level {
+	int count, size;
+	int *pages;
+	char *keys;                          // keys[i]: separator before pages[i]
+};
+
+// Put <page> (and its separator <key>, unless it's NULL) at position <pos>
+static int level_insert(struct index_level *level, int key_size, int pos,
+                        int page, void *key)
+{
+	int *pages;
+	char *keys;
+
+	if (level->count == level->size) {
+		level->size = level->size ? 2 * level->size : 64;
+
+		if (!(pages = realloc(level->pages, level->size * sizeof(int)))) {
+			AM_errno = AME_MALLOC_FAILED;
+			return AME_ERROR;
+		}
+		level->pages = pages;
+
+		if (!(keys = realloc(level->keys, (size_t) level->size * key_size))) {
+			AM_errno = AME_MALLOC_FAILED;
+			return AME_ERROR;
+		}
+		level->keys = keys;
+	}
+
+	memmove(level->pages + pos + 1, level->pages + pos,
+	        (level->count - pos) * sizeof(int));
+	memmove(level->keys + (size_t) (pos + 1) * key_size,
+	        level->keys + (size_t) pos * key_size,
+	        (size_t) (level->count - pos) * key_size);
+
+	level->pages[pos] = page;
+	if (key) {
+		memcpy(level->keys + (size_t) pos * key_size, key, key_size);
+	}
+	level->count++;
+
+	return AME_OK;
+}
+
+static int level_add(struct index_level *level, int key_size, int page, void *key)
+{
+	return level_insert(level, key_size, level->count, page, key);
+}
+
+// Position of the block <key> belongs to
+static int level_find(struct file_entry *file, struct index_level *level, void *key)
+{
+	int i = level->count - 1;
+
+	while (i && compare_key(file, level->keys + (size_t) i * file->key_size, key) > 0) {
+		i--;
+	}
+
+	return i;
+}
+
+static void level_destroy(struct index_level *level)
+{
+	free(level->pages);
+	free(level->keys);
+}
+
+/* Bulk loading.
+ * The records go into leaves in key order, each leaf allocated right after the
+ * previous one, so that the data list is contiguous in the file. Each level of
+ * the index is then built from the (page, separator) pairs of the one below,
+ * until a single node is left: the root. The records are put one at a time,
+ * so that they can come from anywhere, like the leaves of another index */
+
+// The leaf being filled by a bulk load, and the level of leaves so far
+struct bulk {
+	struct index_level *level;
+	PF_Page *bl;                           // The leaf's, child or sibling page
+	BT_Leaf *leaf;                         // NULL before the first record
+	char last[BT_MAX_KEY];                 // Key of the last record put
+	int page, limit, next;
+};
+
+static void bulk_begin(struct file_entry *file, struct bulk *bulk, int fill,
+                       struct index_level *level)
+{
+	bulk->level = level;
+	bulk->bl = file->child_page;
+	bulk->leaf = NULL;
+	bulk->page = 0;
+	bulk->limit = file->max_records * fill / 100;
+	bulk->next = 1;
+}
+
+/* Start a new leaf after the current one, whose last key is <last>, for
+ * <key>. The current leaf stays pinned, in the other page */
+static int bulk_leaf(struct file_entry *file, struct bulk *bulk, char *last,
+                     char *key)
+{
+	char sep[BT_MAX_KEY];
+	int prev = bulk->page;
+
+	bulk->bl = bulk->bl == file->child_page ? file->sibling_page
+	                                        : file->child_page;
+
+	/* An index without a root has no free pages: the new leaf is the next
+	 * page of the file */
+	CALL_BF(PF_GetPageCounter(&file->pf, &bulk->page));
+
+	if (bulk->leaf) {
+		bulk->leaf->next_block = bulk->page;
+
+		memcpy(sep, key, file->key_size);
+		separator_key(file, last, sep);
+	} else {
+		file->header.data_head = bulk->page;
+	}
+
+	bulk->leaf = create_leaf(file, &bulk->bl, &bulk->page);
+	bulk->leaf->prev_block = prev;
+
+	if (level_add(bulk->level, file->key_size, bulk->page,
+	              bulk->level->count ? sep : NULL) != AME_OK) {
+		PF_UnpinPage(bulk->bl);
+		return AME_ERROR;
+	}
+
+	return AME_OK;
+}
+
+// Put the record (<key>, <value>), key normalized, after those put so far
+static int bulk_put(struct file_entry *file, struct bulk *bulk, char *key,
+                    char *value)
+{
+	PF_Page *bl = bulk->bl;
+	BT_Leaf *leaf = bulk->leaf;
+	char last[BT_MAX_KEY], moved[BT_MAX_KEY];
+	int i, run = 0;
+
+	/* A run of equal keys that outgrows the leaf moves out of it, to start
+	 * the next one (unless it fills a leaf on its own) */
+	if (leaf && leaf_full(file, leaf, key) && !compare_key(file, bulk->last, key) &&
+	    (run = leaf_find_first(file, leaf, key))) {
+		leaf_key(file, leaf, run - 1, last);
+
+		if (bulk_leaf(file, bulk, last, key) != AME_OK) {
+			PF_UnpinPage(bl);
+			return AME_ERROR;
+		}
+
+		for (i = run; i < leaf->record_count; ++i) {
+			leaf_key(file, leaf, i, moved);
+			insert_leaf_nonfull(file, bulk->leaf, moved, record(file, leaf, i, 1));
+		}
+
+		leaf->record_count = run;
+	/* On to a new leaf when this one is filled up, but keep a run of equal
+	 * keys together while there is room for it */
+	} else if (bulk->next || leaf_full(file, leaf, key) ||
+	           (leaf->record_count >= bulk->limit &&
+	            compare_key(file, bulk->last, key))) {
+		bulk->next = 0;
+
+		if (bulk_leaf(file, bulk, bulk->last, key) != AME_OK) {
+			if (leaf) {
+				PF_UnpinPage(bl);
+			}
+
+			return AME_ERROR;
+		}
+	} else {
+		bl = NULL;
+	}
+
+	if (leaf && bl) {
+		PF_Page_SetDirty(bl);
+		CALL_BF(PF_UnpinPage(bl));
+	}
+
+	insert_leaf_nonfull(file, bulk->leaf, key, value);
+	memcpy(bulk->last, key, file->key_size);
+
+	return AME_OK;
+}
+
+static int bulk_end(struct file_entry *file, struct bulk *bulk)
+{
+	if (bulk->leaf) {
+		PF_Page_SetDirty(bulk->bl);
+		CALL_BF(PF_UnpinPage(bulk->bl));
+	}
+
+	file->header.data_tail = bulk->page;
+
+	return AME_OK;
+}
+
+/* Build the level of nodes above <below> into <above>, filling each up to
+ * <fill> percent. The separator before each node is that of its first child */
+static int bulk_nodes(struct file_entry *file, struct index_level *below,
+                      int fill, struct index_level *above)
+{
+	PF_Page *bl = file->parent_page;
+	BT_Node *node = NULL;
+	char *sep;
+	int i, page, limit = file->max_keys * fill / 100;
+
+	// At least two children a node, or the levels would never narrow down
+	if (limit < 1) {
+		limit = 1;
+	}
+
+	above->count = 0;
+
+	for (i = 0; i < below->count; ++i) {
+		sep = below->keys + (size_t) i * file->key_size;
+
+		if (node && node->key_count < limit && !node_full(file, node, sep)) {
+			insert_node_nonfull(file, node, sep, below->pages[i]);
+			continue;
+		}
+
+		if (node) {
+			PF_Page_SetDirty(bl);
+			CALL_BF(PF_UnpinPage(bl));
+		}
+
+		CALL_BF(bt_allocate(file, bl, &page));
+		node = (BT_Node *) PF_Page_GetData(bl);
+
+		*pointer(file, node, 0) = below->pages[i];
+
+		if (level_add(above, file->key_size, page, i ? sep : NULL) != AME_OK) {
+			PF_UnpinPage(bl);
+			return AME_ERROR;
+		}
+	}
+
+	PF_Page_SetDirty(bl);
+	CALL_BF(PF_UnpinPage(bl));
+
+	return AME_OK;
+}
+
+/* Batched inserts.
+ * One descent finds the leaf of the next record, and every record of the batch
+ * that belongs to that leaf goes in with it. The leaf and the blocks split off
+ * it make up a level (part of one) that takes the records. The separators of
+ * the new blocks then go up to the parent the same way, one level at a time */
+
+// Have page <page> pinned in <bl>, instead of page <*current> (-1 for none)
+static int batch_page(struct file_entry *file, PF_Page *bl, int *current, int page)
+{
+	if (*current == page) {
+		return AME_OK;
+	}
+
+	if (*current != -1) {
+		*current = -1;
+		PF_Page_SetDirty(bl);
+		CALL_BF(PF_UnpinPage(bl));
+	}
+
+	CALL_BF(PF_GetPage(&file->pf, page, bl));
+	*current = page;
+
+	return AME_OK;
+}
+
+/* Put <key> in the block of <level> it belongs to: as a record with <value> in
+ * a leaf, or as a (key, pointer) pair with *value in a node, right after the
+ * pointer to <left>. A full block is split, and the new one joins the level */
+static int level_put(struct file_entry *file, struct index_level *level,
+                     PF_Page *bl, int *current, char *key, void *value,
+                     int left)
+{
+	char sep[BT_MAX_KEY];
+	BT_Node *node;
+	int i = level_find(file, level, key), page, at, right;
+
+	if (batch_page(file, bl, current, level->pages[i]) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	node = (BT_Node *) PF_Page_GetData(bl);
+
+	// Separators equal to <key> may put <left> in an earlier node
+	while (!node->is_leaf && i > 0 && node_child(file, node, left) < 0 &&
+	       !compare_key(file, level->keys + (size_t) i * file->key_size, key)) {
+		if (batch_page(file, bl, current, level->pages[--i]) != AME_OK) {
+			return AME_ERROR;
+		}
+
+		node = (BT_Node *) PF_Page_GetData(bl);
+	}
+
+	if (node->is_leaf ? leaf_full(file, (BT_Leaf *) node, key) :
+	                    node_full(file, node, key)) {
+		if (node->is_leaf) {
+			page = split_leaf(file, (BT_Leaf *) node, *current, key,
+			                  sep);
+		} else {
+			page = split_node(file, node, key, sep);
+		}
+
+		right = compare_key(file, sep, key) <= 0 &&
+		        (node->is_leaf || node_child(file, node, left) < 0);
+
+		if (level_insert(level, file->key_size, i + 1, page, sep) != AME_OK ||
+		    (right && batch_page(file, bl, current, page) != AME_OK)) {
+			return AME_ERROR;
+		}
+
+		node = (BT_Node *) PF_Page_GetData(bl);
+	}
+
+	if (node->is_leaf) {
+		at = insert_leaf_nonfull(file, (BT_Leaf *) node, key, value);
+		if (at < 0) {
+			AM_errno = AME_DUPLICATE_KEY;
+			return AME_ERROR;
+		}
+
+		bt_note_insert(file, *current, at);
+	} else {
+		insert_node_after(file, node, left, key, *(int *) value);
+	}
+
+	return AME_OK;
+}
+
+// Insert the records of <batch> from the <from>-th on, into a tree with a root
+static int batch_insert(struct file_entry *file, struct batch *batch, int from)
+{
+	struct index_level levels[2] = {{0}}, *below = &levels[0], *above = &levels[1], *temp;
+	struct stack stack;
+	struct bt_bounds bounds;
+	PF_Page *bl = file->child_page;
+	char key[BT_MAX_KEY], *k, *value;
+	int i = from, t, pos, current = -1, result = AME_OK;
+
+	// Its leaf may split
+	file->finger = 0;
+
+	while (i < batch->count && result == AME_OK) {
+		k = batch_record(file, batch, i, key, &value);
+
+		below->count = 0;
+		pos = bt_search_bounded(file, k, &stack, &bounds);
+		result = level_add(below, file->key_size, pos, NULL);
+
+		// Everything short of the leaf's upper bound belongs to it
+		while (result == AME_OK) {
+			result = level_put(file, below, bl, &current, k, value, 0);
+
+			if (++i == batch->count) {
+				break;
+			}
+
+			k = batch_record(file, batch, i, key, &value);
+			if (!bt_in_bounds(file, &bounds, k)) {
+				break;
+			}
+		}
+
+		// Move the new separators up, a level at a time
+		while (result == AME_OK && below->count > 1) {
+			above->count = 0;
+
+			// The root has split: a new one goes over it
+			if (!(pos = stack_pop(&stack))) {
+				if (current != -1) {
+					current = -1;
+					PF_Page_SetDirty(bl);
+					CALL_BF(PF_UnpinPage(bl));
+				}
+
+				CALL_BF(bt_allocate(file, bl, &pos));
+				current = pos;
+
+				*pointer(file, (BT_Node *) PF_Page_GetData(bl), 0) =
+					file->header.root;
+				file->header.root = pos;
+			}
+
+			result = level_add(above, file->key_size, pos, NULL);
+
+			for (t = 1; t < below->count && result == AME_OK; ++t) {
+				result = level_put(file, above, bl, &current,
+				                   below->keys + (size_t) t * file->key_size,
+				                   &below->pages[t], below->pages[t - 1]);
+			}
+
+			temp = below;
+			below = above;
+			above = temp;
+		}
+	}
+
+	if (current != -1) {
+		PF_Page_SetDirty(bl);
+		CALL_BF(PF_UnpinPage(bl));
+	}
+
+	level_destroy(&levels[0]);
+	level_destroy(&levels[1]);
+
+	return result;
+}
+
+// Build the levels of nodes over the leaves in levels[0], up to the root
+static int bulk_nodes_up(struct file_entry *file, struct index_level *levels,
+                         int fill)
+{
+	struct index_level *below = &levels[0], *above = &levels[1], *temp;
+	int result;
+
+	// At least one node over the leaves, as with AM_InsertEntry
+	do {
+		result = bulk_nodes(file, below, fill, above);
+
+		temp = below;
+		below = above;
+		above = temp;
+	} while (result == AME_OK && below->count > 1);
+
+	if (result == AME_OK) {
+		file->header.root = below->pages[0];
+	}
+
+	return result;
+}
+
+// Build the tree of an empty index from <batch> bottom-up
+static int bulk_build(struct file_entry *file, struct batch *batch, int fill)
+{
+	struct index_level levels[2] = {{0}};
+	struct bulk bulk;
+	char key[BT_MAX_KEY], *k, *value;
+	int i, result = AME_OK;
+
+	bulk_begin(file, &bulk, fill, &levels[0]);
+
+	for (i = 0; i < batch->count && result == AME_OK; ++i) {
+		k = batch_record(file, batch, i, key, &value);
+		result = bulk_put(file, &bulk, k, value);
+	}
+
+	if (result == AME_OK) {
+		result = bulk_end(file, &bulk);
+	}
+
+	if (result == AME_OK) {
+		result = bulk_nodes_up(file, levels, fill);
+	}
+
+	level_destroy(&levels[0]);
+	level_destroy(&levels[1]);
+
+	return result;
+}
+
+/* An empty index is built bottom-up. Otherwise the records are inserted as a
+ * batch */
+int AM_BulkLoad(int fileDesc, void *value1, void *value2, int count, int fillFactor)
+{
+	struct file_entry *file;
+	struct batch batch = { value1, value2, count, NULL, NULL, 0 };
+	int result;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	if (!fillFactor) {
+		fillFactor = 100;
+	} else if (fillFactor < 1 || fillFactor > 100) {
+		AM_errno = AME_INVALID_FILL_FACTOR;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+
+	if (count <= 0) {
+		return AME_OK;
+	}
+
+	if (batch_sort(file, &batch) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	if (batch_unique(file, &batch) != AME_OK) {
+		batch_destroy(&batch);
+		return AME_ERROR;
+	}
+
+	result = file->header.root ? batch_insert(file, &batch, 0)
+	                           : bulk_build(file, &batch, fillFactor);
+	batch_destroy(&batch);
+
+	return result;
+}
+
+int AM_InsertBatch(int fileDesc, const void *keys, const void *values, size_t n)
+{
+	struct file_entry *file;
+	struct batch batch = { (char *) keys, (char *) values, (int) n, NULL, NULL, 0 };
+	char buffer[BT_MAX_KEY], *key, *value;
+	int from = 0, result = AME_OK;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+
+	if (!n) {
+		return AME_OK;
+	}
+
+	if (batch_sort(file, &batch) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	if (batch_unique(file, &batch) != AME_OK) {
+		batch_destroy(&batch);
+		return AME_ERROR;
+	}
+
+	/* The first record makes the root, if there is none yet. Not through
+	 * AM_InsertEntry: with a memtable it would stay out of the tree */
+	if (!file->header.root) {
+		key = batch_record(file, &batch, 0, buffer, &value);
+		result = plant_root(file, key, value);
+		from = 1;
+	}
+
+	if (result == AME_OK) {
+		result = batch_insert(file, &batch, from);
+	}
+
+	batch_destroy(&batch);
+
+	return result;
+}
+
+/* Memtable (AM_OPT_MEMTABLE)
+ * Records wait in memory, in key order, and go into the tree as one batch
+ * (each leaf written once) when the memtable fills up, on AM_MergeMemtable and
+ * on AM_CloseIndex. Scans merge them with the records of the tree */
+static int memtable_merge(struct file_entry *file)
+{
+	struct batch batch = { file->memtable_keys, file->memtable_values,
+	                       file->memtable_count, NULL, NULL, 1 };
+	int result;
+
+	if (!file->memtable_count) {
+		return AME_OK;
+	}
+
+	result = file->header.root ? batch_insert(file, &batch, 0)
+	                           : bulk_build(file, &batch, 100);
+
+	if (result == AME_OK) {
+		file->memtable_count = 0;
+	}
+
+	return result;
+}
+
+// Insert, after any equal keys, and merge if that fills the memtable
+static int memtable_insert(struct file_entry *file, void *key, void *value2)
+{
+	const int key_size = file->key_size, value_size = file->value_size;
+	int pos = key_bound(file, file->memtable_keys, key_size,
+	                    file->memtable_count, key, 1);
+
+	memmove(file->memtable_keys + (size_t) (pos + 1) * key_size,
+	        file->memtable_keys + (size_t) pos * key_size,
+	        (size_t) (file->memtable_count - pos) * key_size);
+	memmove(file->memtable_values + (size_t) (pos + 1) * value_size,
+	        file->memtable_values + (size_t) pos * value_size,
+	        (size_t) (file->memtable_count - pos) * value_size);
+
+	memcpy(file->memtable_keys + (size_t) pos * key_size, key, key_size);
+	memcpy(file->memtable_values + (size_t) pos * value_size, value2, value_size);
+
+	if (++file->memtable_count == file->memtable_size) {
+		return memtable_merge(file);
+	}
+
+	return AME_OK;
+}
+
+// First memtable record with key > value (upper != 0) or >= value
+static int memtable_bound(struct file_entry *file, void *value, int upper)
+{
+	return key_bound(file, file->memtable_keys, file->key_size,
+	                 file->memtable_count, value, upper);
+}
+
+// The memtable records in the range of <scan>, by its op
+static void memtable_range(struct file_entry *file, struct scan_entry *scan)
+{
+	int lower = memtable_bound(file, scan->value, 0);
+	int upper = memtable_bound(file, scan->value, 1);
+
+	scan->mem_next = 0;
+	scan->mem_end = file->memtable_count;
+	scan->mem_skip = scan->mem_resume = -1;
+
+	switch (scan->op) {
+	case EQUAL:
+		scan->mem_next = lower;
+		scan->mem_end = upper;
+		break;
+	case NOT_EQUAL:
+		scan->mem_skip = lower;
+		scan->mem_resume = upper;
+		break;
+	case LESS_THAN:
+		scan->mem_end = lower;
+		break;
+	case GREATER_THAN:
+		scan->mem_next = upper;
+		break;
+	case LESS_THAN_OR_EQUAL:
+		scan->mem_end = upper;
+		break;
+	case GREATER_THAN_OR_EQUAL:
+		scan->mem_next = lower;
+		break;
+	case BETWEEN:
+		scan->mem_next = lower;
+		scan->mem_end = memtable_bound(file, scan->high, 1);
+		break;
+	}
+}
+
+int AM_MergeMemtable(int fileDesc)
+{
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	return memtable_merge(open_files.entry[fileDesc]);
+}
+
+// Drop the memtable records with key <key> (and value <value2>, if not NULL)
+static int memtable_delete(struct file_entry *file, void *key, void *value2)
+{
+	const int key_size = file->key_size, value_size = file->value_size;
+	int i, from, to, kept;
+
+	if (!file->memtable_count) {
+		return 0;
+	}
+
+	from = memtable_bound(file, key, 0);
+	to = memtable_bound(file, key, 1);
+
+	for (i = kept = from; i < to; ++i) {
+		if (!value2 || !memcmp(file->memtable_values + (size_t) i * value_size,
+		                       value2, value_size)) {
+			continue;
+		}
+
+		memcpy(file->memtable_values + (size_t) kept * value_size,
+		       file->memtable_values + (size_t) i * value_size, value_size);
+		kept++;
+	}
+
+	memmove(file->memtable_keys + (size_t) kept * key_size,
+	        file->memtable_keys + (size_t) to * key_size,
+	        (size_t) (file->memtable_count - to) * key_size);
+	memmove(file->memtable_values + (size_t) kept * value_size,
+	        file->memtable_values + (size_t) to * value_size,
+	        (size_t) (file->memtable_count - to) * value_size);
+	file->memtable_count -= to - kept;
+
+	return to - kept;
+}
+
+/* Rebalance: the root, left with a single child, hands its buffered messages
+ * down to it before giving way. They are newer than the child's, so they go
+ * after those with equal keys. 0 if they don't fit: the root stays */
+static int root_gives_way(struct file_entry *file, BT_Node *root)
+{
+	PF_Page *bl = file->child_page;
+	BT_Node *child;
+	int i, fits;
+
+	if (!(file->header.flags & BT_MESSAGE_BUFFERS) || !*message_count(file, root)) {
+		return 1;
+	}
+
+	if (PF_GetPage(&file->pf, *pointer(file, root, 0), bl) != BF_OK) {
+		return 0;
+	}
+
+	child = (BT_Node *) PF_Page_GetData(bl);
+	fits = *message_count(file, child) + *message_count(file, root) <=
+	       file->max_messages;
+
+	for (i = 0; fits && i < *message_count(file, root); ++i) {
+		buffer_message(file, child, message(file, root, i, 0),
+		               message(file, root, i, 1));
+	}
+
+	if (fits) {
+		*message_count(file, root) = 0;
+		PF_Page_SetDirty(bl);
+	}
+
+	PF_UnpinPage(bl);
+
+	return fits;
+}
+
+/* Delete: the leaf <key> belongs to has fallen under half full. It is joined
+ * with a sibling under the same parent, the right one if there is one: the two
+ * merge if they fit in one block, giving the other back to the free list and
+ * taking its key out of the parent, which may fall short in turn. Otherwise
+ * they share their entries. A root left with a single child node gives way to
+ * it (a leaf stays under a root, as AM_InsertEntry has it) */
+static int rebalance(struct file_entry *file, struct stack *stack, void *key)
+{
+	PF_Page *parent = file->parent_page;
+	PF_Page *left = file->child_page, *right = file->sibling_page;
+	BT_Node *node, *block;
+	char sep[BT_MAX_KEY];
+	int pos, i, joined, is_leaf, short_of_keys;
+
+	while ((pos = stack_pop(stack))) {
+		CALL_BF(PF_GetPage(&file->pf, pos, parent));
+		node = (BT_Node *) PF_Page_GetData(parent);
+
+		// Key i separates the block on the path from its sibling
+		i = node_find(file, node, key);
+		if (i == node->key_count) {
+			i--;
+		}
+
+		if (i < 0) {
+			CALL_BF(PF_UnpinPage(parent));
+			break;
+		}
+
+		CALL_BF(PF_GetPage(&file->pf, *pointer(file, node, i), left));
+		CALL_BF(PF_GetPage(&file->pf, *pointer(file, node, i + 1), right));
+
+		block = (BT_Node *) PF_Page_GetData(left);
+		is_leaf = block->is_leaf;
+		node_key(file, node, i, sep);
+
+		if (is_leaf) {
+			joined = join_leaves(file, (BT_Leaf *) block,
+			                     (BT_Leaf *) PF_Page_GetData(right), sep);
+
+			if (joined == 1 &&
+			    *pointer(file, node, i + 1) == file->header.data_tail) {
+				file->header.data_tail = *pointer(file, node, i);
+			}
+		} else {
+			joined = join_nodes(file, block,
+			                    (BT_Node *) PF_Page_GetData(right), sep);
+		}
+
+		PF_Page_SetDirty(left);
+		CALL_BF(PF_UnpinPage(left));
+
+		if (joined == 1) {
+			bt_free(file, right, *pointer(file, node, i + 1));
+			remove_key(file, node, i);
+		} else {
+			PF_Page_SetDirty(right);
+			CALL_BF(PF_UnpinPage(right));
+
+			if (!joined) {
+				set_key(file, node, i, sep);
+			}
+		}
+
+		if (pos == file->header.root && !node->key_count && !is_leaf &&
+		    root_gives_way(file, node)) {
+			file->header.root = *pointer(file, node, 0);
+			bt_free(file, parent, pos);
+			break;
+		}
+
+		short_of_keys = node->key_count < file->max_keys / 2;
+
+		PF_Page_SetDirty(parent);
+		CALL_BF(PF_UnpinPage(parent));
+
+		// Only a merge takes a key out of the parent
+		if (joined != 1 || pos == file->header.root || !short_of_keys) {
+			break;
+		}
+	}
+
+	return AME_OK;
+}
+
+/* Remove the records with key <value1> and second field <value2> (any second
+ * field, if NULL), wherever they wait: memtable, message buffers or leaf.
+ * A leaf left under half full is rebalanced (see above) */
+int AM_DeleteEntry(int fileDesc, void *value1, void *value2)
+{
+	struct file_entry *file;
+	struct stack stack;
+	PF_Page *child;
+	BT_Leaf *leaf;
+	char key[BT_MAX_KEY];
+	int pos, from, to, last_block, last, next, removed, values;
+	int short_of_records = 0;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+	child = file->child_page;
+
+	normalize_key(file, key, value1);
+
+	removed = memtable_delete(file, key, value2);
+
+	if (file->header.root) {
+		if (drain_buffers(file, key, key) != AME_OK) {
+			return AME_ERROR;
+		}
+
+		// The leaf's range may change, or the leaf go
+		file->finger = 0;
+
+		if (key_run(file, key, &pos, &from, &last_block, &last) != AME_OK) {
+			return AME_ERROR;
+		}
+
+		/* A run of equal keys over several leaves goes from all of them.
+		 * Only the last one, where the key leads, is rebalanced */
+		for (;;) {
+			CALL_BF(PF_GetPage(&file->pf, pos, child));
+			leaf = (BT_Leaf *) PF_Page_GetData(child);
+
+			to = pos == last_block ? last + 1 : leaf->record_count;
+
+			// Posting lists may lose values and keep their record
+			values = remove_values(file, leaf, from, to, value2);
+
+			if (values) {
+				removed += values;
+				short_of_records = pos == last_block &&
+				                   leaf->record_count < file->max_records / 2;
+				PF_Page_SetDirty(child);
+			}
+
+			next = leaf->next_block;
+			CALL_BF(PF_UnpinPage(child));
+
+			if (pos == last_block) {
+				break;
+			}
+
+			pos = next;
+			from = 0;
+		}
+
+		if (short_of_records) {
+			bt_search(file, key, &stack);
+
+			if (rebalance(file, &stack, key) != AME_OK) {
+				return AME_ERROR;
+			}
+		}
+	}
+
+	if (!removed) {
+		AM_errno = AME_NOT_FOUND;
+		return AME_ERROR;
+	}
+
+	return AME_OK;
+}
+
+/* Range deletes
+ * The two paths down to the leaves of <low> and <high> are cut: a node on both
+ * keeps the children either side of the range next to each other, one on the
+ * left path loses all children right of it and one on the right path all left
+ * of it. The subtrees in between go whole. Their nodes go on the free list,
+ * but their leaves, one run of the data list, are put on the list of free
+ * leaves at once (see bt_allocate), without being read, unless they have
+ * posting lists to free. The two paths are then rebalanced top down. The
+ * leftmost and rightmost paths stand in for a missing bound, so the index
+ * never loses its first and last leaves */
+
+// What range_cut() found
+struct range_cut {
+	int left, right;                       // Leaves either side of the range
+	int last;                              // Last leaf dropped, if any
+};
+
+// Drop the subtree at <pos>, <levels> above the leaves (see above)
+static int drop_subtree(struct file_entry *file, int pos, int levels,
+                        struct range_cut *cut)
+{
+	PF_Page *bl = file->sibling_page;
+	BT_Node *node;
+	BT_Leaf *leaf;
+	int i, n, head, *children, result = AME_OK;
+
+	if (!levels) {
+		if (file->header.flags & BT_POSTING_LISTS) {
+			CALL_BF(PF_GetPage(&file->pf, pos, bl));
+			leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+			for (i = 0; i < leaf->record_count; ++i) {
+				if ((head = leaf_posting(file, leaf, i))) {
+					posting_remove(file, head, NULL);
+				}
+			}
+
+			CALL_BF(PF_UnpinPage(bl));
+		}
+
+		cut->last = pos;
+		return AME_OK;
+	}
+
+	CALL_BF(PF_GetPage(&file->pf, pos, bl));
+	node = (BT_Node *) PF_Page_GetData(bl);
+
+	n = node->key_count + 1;
+	children = malloc(n * sizeof(int));
+	if (!children) {
+		PF_UnpinPage(bl);
+		AM_errno = AME_MALLOC_FAILED;
+		return AME_ERROR;
+	}
+
+	for (i = 0; i < n; ++i) {
+		children[i] = *pointer(file, node, i);
+	}
+
+	bt_free(file, bl, pos);
+
+	// Leaves without lists need not be read: only the last one matters
+	if (levels == 1 && !(file->header.flags & BT_POSTING_LISTS)) {
+		cut->last = children[n - 1];
+		n = 0;
+	}
+
+	for (i = 0; i < n && result == AME_OK; ++i) {
+		result = drop_subtree(file, children[i], levels - 1, cut);
+	}
+
+	free(children);
+
+	return result;
+}
+
+/* Cut the subtree at <pos>, <levels> above the leaves, on the left (<side> 1),
+ * right (2) or both (3) paths of the range [low, high) */
+static int range_cut(struct file_entry *file, int pos, int levels, void *low,
+                     void *high, int side, struct range_cut *cut)
+{
+	PF_Page *bl = file->parent_page;
+	BT_Node *node;
+	BT_Leaf *leaf;
+	int i, lo, hi, from, to, lo_child, hi_child, *dropped, n, result = AME_OK;
+
+	if (!levels) {
+		bl = file->child_page;
+
+		CALL_BF(PF_GetPage(&file->pf, pos, bl));
+		leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+		from = side & 1 && low ? leaf_find_first(file, leaf, low) : 0;
+		to = side & 2 && high ? leaf_find_first(file, leaf, high)
+		                      : leaf->record_count;
+
+		if (from < to) {
+			remove_values(file, leaf, from, to, NULL);
+			PF_Page_SetDirty(bl);
+		}
+
+		if (side & 1) {
+			cut->left = pos;
+		}
+
+		if (side & 2) {
+			cut->right = pos;
+		}
+
+		CALL_BF(PF_UnpinPage(bl));
+		return AME_OK;
+	}
+
+	CALL_BF(PF_GetPage(&file->pf, pos, bl));
+	node = (BT_Node *) PF_Page_GetData(bl);
+
+	/* Children lo and hi are on the paths; those in between go. Both are
+	 * the first that may hold their key: a run of equal keys can go on
+	 * over several leaves, and those of low are in the range, those of
+	 * high are not */
+	lo = side & 1 ? (low ? node_find_first(file, node, low) : 0) : -1;
+	hi = side & 2 ? (high ? node_find_first(file, node, high) : node->key_count)
+	              : node->key_count + 1;
+
+	if (lo == hi) {
+		pos = *pointer(file, node, lo);
+		CALL_BF(PF_UnpinPage(bl));
+
+		return range_cut(file, pos, levels - 1, low, high, side, cut);
+	}
+
+	lo_child = lo >= 0 ? *pointer(file, node, lo) : 0;
+	hi_child = hi <= node->key_count ? *pointer(file, node, hi) : 0;
+
+	n = hi - lo - 1;
+	dropped = malloc((n + 1) * sizeof(int));
+	if (!dropped) {
+		PF_UnpinPage(bl);
+		AM_errno = AME_MALLOC_FAILED;
+		return AME_ERROR;
+	}
+
+	for (i = 0; i < n; ++i) {
+		dropped[i] = *pointer(file, node, lo + 1 + i);
+	}
+
+	// Child hi moves to the front if there is no child lo
+	if (lo < 0) {
+		*pointer(file, node, 0) = hi_child;
+		remove_keys(file, node, 0, hi);
+	} else {
+		remove_keys(file, node, lo, lo + n);
+	}
+
+	PF_Page_SetDirty(bl);
+	CALL_BF(PF_UnpinPage(bl));
+
+	// In key order, for the last leaf dropped
+	if (lo_child) {
+		result = range_cut(file, lo_child, levels - 1, low, high, 1, cut);
+	}
+
+	for (i = 0; i < n && result == AME_OK; ++i) {
+		result = drop_subtree(file, dropped[i], levels - 1, cut);
+	}
+
+	if (hi_child && result == AME_OK) {
+		result = range_cut(file, hi_child, levels - 1, low, high, 2, cut);
+	}
+
+	free(dropped);
+
+	return result;
+}
+
+/* Rebalance the path to the first leaf of <key>, as range_cut() took it (the
+ * leftmost or, if <last>, the rightmost one if NULL) top down: a child short
+ * of entries is joined with a sibling, as in rebalance(), until it isn't or
+ * it can't be. A root left with a single child node gives way to it */
+static int fix_path(struct file_entry *file, void *key, int last)
+{
+	PF_Page *parent = file->parent_page;
+	PF_Page *left = file->child_page, *right = file->sibling_page;
+	BT_Node *node, *child;
+	char sep[BT_MAX_KEY];
+	int pos = file->header.root, i, j, page, joined, is_leaf, is_short;
+	int shared = 0;
+
+	for (;;) {
+		CALL_BF(PF_GetPage(&file->pf, pos, parent));
+		node = (BT_Node *) PF_Page_GetData(parent);
+
+		i = key ? node_find_first(file, node, key) : last ? node->key_count : 0;
+		page = *pointer(file, node, i);
+
+		CALL_BF(PF_GetPage(&file->pf, page, left));
+		child = (BT_Node *) PF_Page_GetData(left);
+		is_leaf = child->is_leaf;
+		is_short = is_leaf ? ((BT_Leaf *) child)->record_count <
+		                     file->max_records / 2
+		                   : child->key_count < file->max_keys / 2;
+		CALL_BF(PF_UnpinPage(left));
+
+		if (pos == file->header.root && !node->key_count && !is_leaf &&
+		    root_gives_way(file, node)) {
+			file->header.root = page;
+			bt_free(file, parent, pos);
+			pos = page;
+			continue;
+		}
+
+		// On down, once the child is fine or as good as it gets
+		if (!is_short || shared || !node->key_count) {
+			CALL_BF(PF_UnpinPage(parent));
+
+			if (is_leaf) {
+				return AME_OK;
+			}
+
+			pos = page;
+			shared = 0;
+			continue;
+		}
+
+		// Key j separates the child from its sibling
+		j = i < node->key_count ? i : i - 1;
+
+		CALL_BF(PF_GetPage(&file->pf, *pointer(file, node, j), left));
+		CALL_BF(PF_GetPage(&file->pf, *pointer(file, node, j + 1), right));
+		node_key(file, node, j, sep);
+
+		if (is_leaf) {
+			joined = join_leaves(file, (BT_Leaf *) PF_Page_GetData(left),
+			                     (BT_Leaf *) PF_Page_GetData(right), sep);
+
+			if (joined == 1 &&
+			    *pointer(file, node, j + 1) == file->header.data_tail) {
+				file->header.data_tail = *pointer(file, node, j);
+			}
+		} else {
+			joined = join_nodes(file, (BT_Node *) PF_Page_GetData(left),
+			                    (BT_Node *) PF_Page_GetData(right), sep);
+		}
+
+		PF_Page_SetDirty(left);
+		CALL_BF(PF_UnpinPage(left));
+
+		if (joined == 1) {
+			bt_free(file, right, *pointer(file, node, j + 1));
+			remove_key(file, node, j);
+		} else {
+			PF_Page_SetDirty(right);
+			CALL_BF(PF_UnpinPage(right));
+
+			if (!joined) {
+				set_key(file, node, j, sep);
+			}
+
+			shared = 1;
+		}
+
+		// A merge may still leave the child short: again, at the same node
+		PF_Page_SetDirty(parent);
+		CALL_BF(PF_UnpinPage(parent));
+	}
+}
+
+int AM_DeleteRange(int fileDesc, void *low, void *high)
+{
+	struct file_entry *file;
+	struct range_cut cut = { 0, 0, 0 };
+	PF_Page *bl;
+	BT_Node *node;
+	char low_key[BT_MAX_KEY], high_key[BT_MAX_KEY], *lo = NULL, *hi = NULL;
+	int from, to, levels, pos, first;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+	bl = file->child_page;
+
+	if (low) {
+		normalize_key(file, low_key, low);
+		lo = low_key;
+	}
+
+	if (high) {
+		normalize_key(file, high_key, high);
+		hi = high_key;
+	}
+
+	if (lo && hi && compare_key(file, lo, hi) >= 0) {
+		return AME_OK;
+	}
+
+	// The memtable
+	from = lo ? memtable_bound(file, lo, 0) : 0;
+	to = hi ? memtable_bound(file, hi, 0) : file->memtable_count;
+
+	if (from < to) {
+		memmove(file->memtable_keys + (size_t) from * file->key_size,
+		        file->memtable_keys + (size_t) to * file->key_size,
+		        (size_t) (file->memtable_count - to) * file->key_size);
+		memmove(file->memtable_values + (size_t) from * file->value_size,
+		        file->memtable_values + (size_t) to * file->value_size,
+		        (size_t) (file->memtable_count - to) * file->value_size);
+		file->memtable_count -= to - from;
+	}
+
+	if (!file->header.root) {
+		return AME_OK;
+	}
+
+	// Buffered records in the range go down, to go with their leaves
+	if (drain_buffers(file, lo, hi) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	file->finger = 0;
+
+	for (levels = 0, pos = file->header.root; ; ++levels) {
+		CALL_BF(PF_GetPage(&file->pf, pos, bl));
+		node = (BT_Node *) PF_Page_GetData(bl);
+
+		if (node->is_leaf) {
+			CALL_BF(PF_UnpinPage(bl));
+			break;
+		}
+
+		pos = *pointer(file, node, 0);
+		CALL_BF(PF_UnpinPage(bl));
+	}
+
+	if (range_cut(file, file->header.root, levels, lo, hi, 3, &cut) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	// The data list skips the leaves dropped, which go on the free list
+	if (cut.last) {
+		CALL_BF(PF_GetPage(&file->pf, cut.left, bl));
+		first = ((BT_Leaf *) PF_Page_GetData(bl))->next_block;
+		((BT_Leaf *) PF_Page_GetData(bl))->next_block = cut.right;
+		PF_Page_SetDirty(bl);
+		CALL_BF(PF_UnpinPage(bl));
+
+		link_prev(file, cut.right, cut.left);
+
+		CALL_BF(PF_GetPage(&file->pf, cut.last, bl));
+		((BT_Leaf *) PF_Page_GetData(bl))->next_block = file->header.free_leaves;
+		PF_Page_SetDirty(bl);
+		CALL_BF(PF_UnpinPage(bl));
+
+		file->header.free_leaves = first;
+	}
+
+	if (fix_path(file, lo, 0) != AME_OK || fix_path(file, hi, 1) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	return AME_OK;
+}
+
+/* Compaction
+ * The records of the tree, read along the leaf chain, are bulk loaded into a
+ * new file next to the index (<name>.compact), which then takes its place.
+ * They go into the new leaves as they are read, so the memory used does not
+ * grow with the index, apart from a page number and a separator per leaf.
+ * The leaves are written one after the other in key order, so a range scan
+ * reads the file front to back, and the free pages are left behind. The index
+ * is only read until the new file is complete: on an error it stays as it was.
+ * The memtable holds no pages and is kept as it is */
+
+/* Bulk load the records of <file>, read along its leaves, into the empty index
+ * <new>. Only a leaf of each is pinned at a time */
+static int compact_copy(struct file_entry *file, struct file_entry *new, int fill)
+{
+	PF_Page *bl = file->child_page;
+	struct bt_posting_cursor cursor = { 0 };
+	struct index_level levels[2] = {{0}};
+	struct bulk bulk;
+	BT_Leaf *leaf;
+	char key[BT_MAX_KEY], *value;
+	int i, head, page = file->header.data_head, result = AME_OK;
+
+	bulk_begin(new, &bulk, fill, &levels[0]);
+
+	while (page && result == AME_OK) {
+		if (PF_GetPage(&file->pf, page, bl) != BF_OK) {
+			AM_errno = AME_BF_ERROR;
+			result = AME_ERROR;
+			break;
+		}
+
+		leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+		for (i = 0; i < leaf->record_count && result == AME_OK; ++i) {
+			leaf_key(file, leaf, i, key);
+
+			if (!(head = leaf_posting(file, leaf, i))) {
+				result = bulk_put(new, &bulk, key, record(file, leaf, i, 1));
+				continue;
+			}
+
+			while (result == AME_OK &&
+			       (value = posting_next(file, &cursor, head))) {
+				result = bulk_put(new, &bulk, key, value);
+			}
+		}
+
+		page = leaf->next_block;
+		PF_UnpinPage(bl);
+	}
+
+	if (result == AME_OK && bulk.leaf) {
+		result = bulk_end(new, &bulk);
+
+		if (result == AME_OK) {
+			result = bulk_nodes_up(new, levels, fill);
+		}
+	}
+
+	level_destroy(&levels[0]);
+	level_destroy(&levels[1]);
+
+	return result;
+}
+
+/* Build the new file <name> holding the records of <file>. Its header is
+ * then in <header> */
+static int compact_build(char *name, struct file_entry *file, BT_Header *header,
+                         int fill)
+{
+	struct file_entry *new;
+	int fd, result = AME_OK;
+
+	new = malloc(sizeof(*new));
+	if (!new) {
+		AM_errno = AME_MALLOC_FAILED;
+		return AME_ERROR;
+	}
+
+	// Same options, no tree
+	new->header = file->header;
+	new->header.root = 0;
+	new->header.data_head = 0;
+	new->header.data_tail = 0;
+	new->header.free_head = 0;
+	new->header.free_leaves = 0;
+	new->finger = 0;
+	memset(new->history, 0, sizeof(new->history));
+	new->read_ahead = READ_AHEAD_MIN;
+
+	remove(name);                                // Left by a failed compaction
+
+	if (BF_CreateFile(name) != BF_OK || BF_OpenFile(name, &fd) != BF_OK) {
+		free(new);
+		AM_errno = AME_BF_ERROR;
+		return AME_ERROR;
+	}
+
+	if (PF_OpenFile(&new->pf, fd, new->header.page_size) != BF_OK) {
+		BF_CloseFile(fd);
+		free(new);
+		AM_errno = AME_BF_ERROR;
+		return AME_ERROR;
+	}
+
+	bt_layout(new);
+
+	if (!file_buffers(new)) {
+		PF_CloseFile(&new->pf);
+		BF_CloseFile(fd);
+		free(new);
+		AM_errno = AME_MALLOC_FAILED;
+		return AME_ERROR;
+	}
+
+	// The header goes on page 0, before the tree takes the next ones
+	if (PF_AllocatePage(&new->pf, new->child_page) != BF_OK ||
+	    PF_UnpinPage(new->child_page) != BF_OK) {
+		AM_errno = AME_BF_ERROR;
+		result = AME_ERROR;
+	} else {
+		result = compact_copy(file, new, fill);
+	}
+
+	if (result == AME_OK && PF_GetPage(&new->pf, 0, new->child_page) == BF_OK) {
+		*(BT_Header *) PF_Page_GetData(new->child_page) = new->header;
+		PF_Page_SetDirty(new->child_page);
+		PF_UnpinPage(new->child_page);
+
+		*header = new->header;
+	} else if (result == AME_OK) {
+		AM_errno = AME_BF_ERROR;
+		result = AME_ERROR;
+	}
+
+	if ((PF_CloseFile(&new->pf) != BF_OK || BF_CloseFile(fd) != BF_OK) &&
+	    result == AME_OK) {
+		AM_errno = AME_BF_ERROR;
+		result = AME_ERROR;
+	}
+
+	free_file_buffers(new);
+	free(new);
+
+	return result;
+}
+
+int AM_CompactIndex(int fileDesc, int fillFactor)
+{
+	struct file_entry *file;
+	BT_Header header;
+	char name[sizeof(file->name) + sizeof(".compact")];
+	int i, fd, result;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	if (!fillFactor) {
+		fillFactor = 100;
+	} else if (fillFactor < 1 || fillFactor > 100) {
+		AM_errno = AME_INVALID_FILL_FACTOR;
+		return AME_ERROR;
+	}
+
+	// Open scans point into the blocks of the file being replaced
+	for (i = 0; i < MAX_SCANS; ++i) {
+		if (open_scans.entry[i] && open_scans.entry[i]->fileDesc == fileDesc) {
+			AM_errno = AME_FILE_IN_USE;
+			return AME_ERROR;
+		}
+	}
+
+	file = open_files.entry[fileDesc];
+
+	// Other descriptors of the file would go on with the old one
+	for (i = 0; i < MAX_OPEN_FILES; ++i) {
+		if (i != fileDesc && open_files.entry[i] &&
+		    !strcmp(file->name, open_files.entry[i]->name)) {
+			AM_errno = AME_FILE_IN_USE;
+			return AME_ERROR;
+		}
+	}
+
+	if (drain_buffers(file, NULL, NULL) != AME_OK) {
+		return AME_ERROR;
+	}
+
+	snprintf(name, sizeof(name), "%s.compact", file->name);
+
+	result = compact_build(name, file, &header, fillFactor);
+
+	if (result != AME_OK) {
+		remove(name);
+		return AME_ERROR;
+	}
+
+	// The swap. The old file is open again if it can't be done
+	CALL_BF(PF_CloseFile(&file->pf));
+	CALL_BF(BF_CloseFile(file->pf.fd));
+
+	if (rename(name, file->name)) {
+		perror("AM_CompactIndex");
+		remove(name);
+
+		AM_errno = AME_REPLACE_ERROR;
+		result = AME_ERROR;
+	} else {
+		file->header = header;
+		file->finger = 0;
+	}
+
+	CALL_BF(BF_OpenFile(file->name, &fd));
+	CALL_BF(PF_OpenFile(&file->pf, fd, file->header.page_size));
+
+	return result;
+}
+
+int AM_OpenIndexScan(int fileDesc, int op, void *value)
+{
+	struct scan_entry *scan;
+	struct file_entry *file;
+	PF_Page *bl;
+	BT_Leaf *leaf;
+	int i, temp, block, entry, result = AME_OK, step = op & DESCENDING ? -1 : 1;
+
+	op &= ~DESCENDING;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+
+	if (open_scans.count == MAX_SCANS) {
+		AM_errno = AME_MAX_SCANS;
+		return AME_ERROR;
+	}
+
+	// Find first NULL (unoccupied) scan entry index.
+	i = 0;
+	while (open_scans.entry[i]) {
+		i++;
+	}
+
+	scan = &open_scans.pool[i];
+
+	if (!scan->page) {
+		PF_Page_Init(&scan->page);
+
+		if (!scan->page) {
+			AM_errno = AME_MALLOC_FAILED;
+			return AME_ERROR;
+		}
+	}
+
+	open_scans.entry[i] = scan;
+
+	scan->fileDesc = fileDesc;
+	scan->op = op;
+	scan->step = step;
+	scan->list = NULL;
+	normalize_key(file, scan->value, value);
+
+	if (op == BETWEEN) {
+		normalize_key(file, scan->high, (char *) value + file->key_size);
+	}
+
+	value = scan->value;
+
+	// Buffered records in the range of the scan must be in the leaves
+	if (((op >= EQUAL && op <= GREATER_THAN_OR_EQUAL) || op == BETWEEN) &&
+	    drain_buffers(file,
+	                  op == EQUAL || op == GREATER_THAN ||
+	                  op == GREATER_THAN_OR_EQUAL || op == BETWEEN ? value : NULL,
+	                  op == BETWEEN ? scan->high :
+	                  op == EQUAL || op == LESS_THAN ||
+	                  op == LESS_THAN_OR_EQUAL ? value : NULL) != AME_OK) {
+		open_scans.entry[i] = NULL;
+		return AME_ERROR;
+	}
+
+	open_scans.count++;
+
+	bl = file->child_page;
+
+	memtable_range(file, scan);
+	scan->ahead = 0;
+	scan->tree_eof = 0;
+	scan->posting.page = 0;
+	scan->leaf = NULL;
+	scan->run = 0;
+	scan->prefetched = 0;
+	scan->window = file->read_ahead;
+
+	/* Everything is still in the memtable, or low > high: an empty tree
+	 * range */
+	if ((!file->header.root && ((op >= EQUAL && op <= GREATER_THAN_OR_EQUAL) ||
+	                            op == BETWEEN)) ||
+	    (op == BETWEEN && compare_key(file, value, scan->high) > 0)) {
+		scan->current_block = 0;
+		scan->end_block = 0;
+		scan->next_entry = 0;
+		scan->end_entry = -1;
+
+		return i;
+	}
+
+	/* Define the start (block, entry) and the end (block, entry) for each op.
+	 * Walking left, NOT_EQUAL starts above <value> */
+	switch (op == NOT_EQUAL && step < 0 ? GREATER_THAN : op) {
+	case EQUAL:         // From the first record with key <value> to the last
+		result = key_run(file, value, &scan->current_block, &scan->next_entry,
+		                 &scan->end_block, &scan->end_entry);
+		break;
+	case NOT_EQUAL: // More on the overlap
+	case LESS_THAN:
+		/* For LESS_THAN(_OR_EQUAL) op, search from the data list head
+		 * until the leaf where <value> is found */
+		scan->current_block = file->header.data_head;
+		scan->next_entry = 0;
+
+		result = key_run(file, value, &scan->end_block, &scan->end_entry,
+		                 &block, &entry);
+		scan->end_entry--;
+		break;
+	case GREATER_THAN:
+		/* For GREATER_THAN(_OR_EQUAL) op, search from the leaf where
+		 * <value> is found until the data list tail */
+		result = key_run(file, value, NULL, NULL,
+		                 &scan->current_block, &scan->next_entry);
+		scan->next_entry++;
+
+		scan->end_block = file->header.data_tail;
+
+		CALL_BF(PF_GetPage(&file->pf, scan->end_block, bl));
+		leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+		scan->end_entry = leaf->record_count - 1;
+		CALL_BF(PF_UnpinPage(bl));
+		break;
+	case LESS_THAN_OR_EQUAL:
+		scan->current_block = file->header.data_head;
+		scan->next_entry = 0;
+
+		result = key_run(file, value, NULL, NULL,
+		                 &scan->end_block, &scan->end_entry);
+		break;
+	case BETWEEN:
+		/* For BETWEEN op, from the first record with key >= <value> until
+		 * the last one with key <= <high>: a descent for each end */
+		result = key_run(file, value, &scan->current_block, &scan->next_entry,
+		                 &block, &entry);
+
+		if (result == AME_OK) {
+			result = key_run(file, scan->high, NULL, NULL,
+			                 &scan->end_block, &scan->end_entry);
+		}
+		break;
+	case GREATER_THAN_OR_EQUAL:
+		result = key_run(file, value, &scan->current_block, &scan->next_entry,
+		                 &block, &entry);
+
+		scan->end_block = file->header.data_tail;
+
+		CALL_BF(PF_GetPage(&file->pf, scan->end_block, bl));
+		leaf = (BT_Leaf *) PF_Page_GetData(bl);
+
+		scan->end_entry = leaf->record_count - 1;
+		CALL_BF(PF_UnpinPage(bl));
+		break;
+	default:
+		// Invalid operation. Terminate scan
+		open_scans.entry[i] = NULL;
+		open_scans.count--;
+
+		AM_errno = AME_INVALID_OP;
+		return AME_ERROR;
+	}
+
+	if (result != AME_OK) {
+		open_scans.entry[i] = NULL;
+		open_scans.count--;
+
+		return AME_ERROR;
+	}
+
+	// DESCENDING: the same range, from its end
+	if (step < 0) {
+		temp = scan->current_block;
+		scan->current_block = scan->end_block;
+		scan->end_block = temp;
+
+		temp = scan->next_entry;
+		scan->next_entry = scan->end_entry;
+		scan->end_entry = temp;
+	}
+
+	return i;
+}
+
+/* IN_LIST: an EQUAL scan on each key of the list in turn, in key order. The
+ * memtable has a single range for a scan, so its records go to the tree first,
+ * as do the buffered ones in the range of the list */
+int AM_OpenIndexScanIn(int fileDesc, void *values, int count)
+{
+	struct file_entry *file;
+	struct scan_entry *scan;
+	char key[BT_MAX_KEY], *list;
+	int i, scanDesc;
+
+	if (!valid_fd(fileDesc)) {
+		AM_errno = AME_INVALID_FD;
+		return AME_ERROR;
+	}
+
+	file = open_files.entry[fileDesc];
+
+	if (count < 1) {
+		AM_errno = AME_INVALID_OP;
+		return AME_ERROR;
+	}
+
+	list = malloc((size_t) count * file->key_size);
+	if (!list) {
+		AM_errno = AME_MALLOC_FAILED;
+		return AME_ERROR;
+	}
+
+	for (i = 0; i < count; ++i) {
+		normalize_key(file, list + (size_t) i * file->key_size,
+		              (char *) values + (size_t) i * file->key_size);
+	}
+
+	sort_file = file;
+	qsort(list, count, file->key_size, compare_keys);
+
+	if (memtable_merge(file) != AME_OK ||
+	    drain_buffers(file, list,
+	                  list + (size_t) (count - 1) * file->key_size) != AME_OK) {
+		free(list);
+		return AME_ERROR;
+	}
+
+	denormalize_key(file, key, list);
+
+	if ((scanDesc = AM_OpenIndexScan(fileDesc, EQUAL, key)) == AME_ERROR) {
+		free(list);
+		return AME_ERROR;
+	}
+
+	scan = open_scans.entry[scanDesc];
+	scan->op = IN_LIST;
+	scan->list = list;
+	scan->list_count = count;
+	scan->list_next = 0;
+
+	return scanDesc;
+}
+
+/* Read-ahead along the leaf chain
+ * A scan that has crossed READ_AHEAD_AFTER leaves in a row through next_block
+ * reads the leaves after its own in before it gets to them: the pointers that
+ * follow it in its parent node, <window> of them at once, so that one descent
+ * gives a whole run of siblings without walking the chain. Every leaf that
+ * was read in ahead grows the window, up to READ_AHEAD_MAX. A scan closed with
+ * leaves read in for nothing halves it. The window carries over to the next
+ * scans on the file */
+
+/* The siblings next to the leaf of <scan> the way it goes, as far as its
+ * window or end_block */
+static void read_ahead(struct scan_entry *scan, struct file_entry *file)
+{
+	PF_Page *bl = file->child_page;
+	BT_Node *node;
+	char key[BT_MAX_KEY];
+	int pages[READ_AHEAD_MAX];
+	int pos = file->header.root, count = 0, i;
+
+	if (scan->current_block == scan->end_block || !scan->leaf->record_count) {
+		return;
+	}
+
+	leaf_key(file, scan->leaf, 0, key);
+
+	// Down to the node that points to the leaf
+	while (pos && pos != scan->current_block) {
+		// No read ahead past a block that cannot be read
+		if (PF_GetPage(&file->pf, pos, bl) != BF_OK) {
+			return;
+		}
+
+		node = (BT_Node *) PF_Page_GetData(bl);
+
+		if (node->is_leaf) {
+			PF_UnpinPage(bl);
+			break;
+		}
+
+		for (i = 0; i <= node->key_count; ++i) {
+			if (*pointer(file, node, i) == scan->current_block) {
+				break;
+			}
+		}
+
+		if (i > node->key_count) {
+			pos = *pointer(file, node, node_find(file, node, key));
+			PF_UnpinPage(bl);
+			continue;
+		}
+
+		while ((i += scan->step) >= 0 && i <= node->key_count &&
+		       count < scan->window) {
+			pages[count] = *pointer(file, node, i);
+
+			if (pages[count++] == scan->end_block) {
+				break;
+			}
+		}
+
+		PF_UnpinPage(bl);
+		break;
+	}
+
+	if (count) {
+		PF_Prefetch(&file->pf, pages, count);
+		scan->prefetched = count;
+	}
+}
+
+// Done with the leaf of <scan>
+static void scan_release(struct scan_entry *scan)
+{
+	if (scan->leaf) {
+		PF_UnpinPage(scan->page);
+		scan->leaf = NULL;
+	}
+}
+
+// Move <scan> to the leaf <block>, pinned in its page
+static int scan_move(struct scan_entry *scan, struct file_entry *file, int block)
+{
+	BF_ErrorCode code;
+
+	if (scan->leaf && block == scan->current_block) {
+		return AME_OK;
+	}
+
+	scan_release(scan);
+
+	code = PF_GetPage(&file->pf, block, scan->page);
+	if (code != BF_OK) {
+		BF_PrintError(code);
+		AM_errno = AME_BF_ERROR;
+		return AME_ERROR;
+	}
+
+	scan->current_block = block;
+	scan->leaf = (BT_Leaf *) PF_Page_GetData(scan->page);
+
+	return AME_OK;
+}
+
+/* IN_LIST: on to the next key of the list, if any. It is looked for in the
+ * leaf of <scan> while it is not past the last record there, so each leaf is
+ * read once for all the keys that fall in it; past that, a descent skips
+ * straight to the run of its key. 1 if there is a next key, 0 if not,
+ * AME_ERROR if its leaf cannot be read (the scan is left on the key it was on) */
+static int scan_list_next(struct scan_entry *scan, struct file_entry *file)
+{
+	BT_Leaf *leaf = scan->leaf;
+	char *done, *key, last[BT_MAX_KEY];
+	int from = scan->list_next, pos, first, end_block, end_entry;
+
+	// Keys given more than once are scanned once
+	done = scan->list + (size_t) scan->list_next * file->key_size;
+	do {
+		if (++scan->list_next == scan->list_count) {
+			return 0;
+		}
+
+		key = scan->list + (size_t) scan->list_next * file->key_size;
+	} while (!compare_key(file, done, key));
+
+	if (leaf->record_count) {
+		leaf_key(file, leaf, leaf->record_count - 1, last);
+	}
+
+	if (!leaf->record_count || compare_key(file, key, last) > 0) {
+		if (key_run(file, key, &pos, &first, &end_block, &end_entry) != AME_OK ||
+		    scan_move(scan, file, pos) != AME_OK) {
+			scan->list_next = from;
+			return AME_ERROR;
+		}
+	} else {
+		// The run of <key> starts in this leaf, and may go on past it
+		first = leaf_find_first(file, leaf, key);
+		end_block = scan->current_block;
+		end_entry = leaf_find_last(file, leaf, key);
+
+		if (end_entry == leaf->record_count - 1 && leaf->next_block &&
+		    key_run(file, key, NULL, NULL, &end_block, &end_entry) != AME_OK) {
+			scan->list_next = from;
+			return AME_ERROR;
+		}
+	}
+
+	scan->next_entry = first;
+	scan->end_block = end_block;
+	scan->end_entry = end_entry;
+
+	return 1;
+}
+
+/* Bring <scan> to its next record in the tree, if any, and return its leaf.
+ * The directions (start, end) come from OpenIndexScan, with one special case:
+ * NOT_EQUAL becomes GREATER_THAN after LESS_THAN. A leaf stays pinned from the
+ * first record the scan takes from it until the scan moves on through
+ * next_block. NULL (AME_EOF) at the end of the scan */
+static BT_Leaf *scan_position(struct scan_entry *scan, struct file_entry *file)
+{
+	PF_Page *bl = file->child_page;
+	BT_Leaf *leaf;
+	BF_ErrorCode code;
+	int more, block, entry, last_block, last;
+
+	for (;;) {
+		// No tree (yet)
+		if (!scan->current_block) {
+			AM_errno = AME_EOF;
+			return NULL;
+		}
+
+		if (!scan->leaf) {
+			code = PF_GetPage(&file->pf, scan->current_block, scan->page);
+			if (code != BF_OK) {
+				BF_PrintError(code);
+				AM_errno = AME_BF_ERROR;
+				return NULL;
+			}
+
+			scan->leaf = (BT_Leaf *) PF_Page_GetData(scan->page);
+
+			// Walking left, a leaf is entered at its last record
+			if (scan->step < 0 &&
+			    scan->next_entry >= scan->leaf->record_count) {
+				scan->next_entry = scan->leaf->record_count - 1;
+			}
+
+			if (scan->run >= READ_AHEAD_AFTER && !scan->prefetched) {
+				read_ahead(scan, file);
+			}
+		}
+
+		if (scan_done(scan) && scan->op == IN_LIST) {
+			if ((more = scan_list_next(scan, file)) == AME_ERROR) {
+				return NULL;
+			} else if (more) {
+				continue;
+			}
+		}
+
+		// If scan ends here and is not the special case NOT_EQUAL, we're done.
+		if (scan_done(scan) && scan->op != NOT_EQUAL) {
+			scan_release(scan);
+			AM_errno = AME_EOF;
+			return NULL;
+		}
+
+		// Walking left, GREATER_THAN is the part done first
+		if (scan_done(scan) && scan->step < 0) {
+			/* LESS_THAN:
+			* - start: the last entry < value in the current block
+			* - end: first entry of first block */
+			scan->op = LESS_THAN;
+
+			// Equal keys may run back over several leaves
+			if (key_run(file, scan->value, &block, &entry, &last_block,
+			            &last) != AME_OK ||
+			    scan_move(scan, file, block) != AME_OK) {
+				scan_release(scan);
+				return NULL;
+			}
+
+			scan->next_entry = entry - 1;
+			scan->end_block = file->header.data_head;
+			scan->end_entry = 0;
+			continue;
+		}
+
+		if (scan_done(scan)) {
+			/* GREATER_THAN:
+			* - start: the first entry >= value in the current block
+			* - end: last entry of last block */
+			scan->op = GREATER_THAN;
+
+			// Equal keys may run on over several leaves
+			if (key_run(file, scan->value, NULL, NULL, &block,
+			            &entry) != AME_OK ||
+			    scan_move(scan, file, block) != AME_OK) {
+				scan_release(scan);
+				return NULL;
+			}
+
+			scan->next_entry = entry + 1;
+			scan->end_block = file->header.data_tail;
+
+			code = PF_GetPage(&file->pf, scan->end_block, bl);
+			if (code != BF_OK) {
+				scan_release(scan);
+				BF_PrintError(code);
+				AM_errno = AME_BF_ERROR;
+				return NULL;
+			}
+
+			leaf = (BT_Leaf *) PF_Page_GetData(bl);
 
 			scan->end_entry = leaf->record_count - 1;
-			BF_UnpinBlock(bl);
+			PF_UnpinPage(bl);
+			continue;
+		}
 
-			BF_Block_Destroy(&bl);          // Cleanup before return
+		if (scan->step > 0 ? scan->next_entry < scan->leaf->record_count
+		                   : scan->next_entry >= 0) {
+			return scan->leaf;
+		}
 
-			/* Recursive call because we need to evaluate the new
-			 * parameters (e.g. whether we're done) */
-			return AM_FindNextEntry(scanDesc);
+		/* Moving on to entry 0 of the next_block, or to the last entry of
+		 * the prev_block */
+		if (scan->step > 0) {
+			scan->current_block = scan->leaf->next_block;
+			scan->next_entry = 0;
+		} else {
+			scan->current_block = scan->leaf->prev_block;
+			scan->next_entry = INT_MAX;
 		}
 
-		AM_errno = AME_EOF;
+		scan_release(scan);
+
+		scan->run++;
+		if (scan->prefetched) {
+			scan->prefetched--;
+
+			if (scan->window < READ_AHEAD_MAX) {
+				scan->window++;
+			}
+		}
+	}
+}
+
+/* The next record of the tree in the range of <scan>, with its key in <key>
+ * (if not NULL) */
+static void *scan_tree(struct scan_entry *scan, struct file_entry *file, void *key)
+{
+	BT_Leaf *leaf;
+	void *found;
+	int head;
+
+	while ((leaf = scan_position(scan, file))) {
+		if (key) {
+			leaf_key(file, leaf, scan->next_entry, key);
+		}
+
+		// A posting list gives its values one by one, from a copy
+		if ((head = leaf_posting(file, leaf, scan->next_entry))) {
+			found = posting_next(file, &scan->posting, head);
+
+			if (found) {
+				return found;
+			}
+
+			scan->next_entry += scan->step;
+			continue;
+		}
+
+		// Normal operation. Return current entry, move on to the next
+		found = record(file, leaf, scan->next_entry, 1);
+		scan->next_entry += scan->step;
+
+		return found;
+	}
+
+	return NULL;
+}
+
+/* Copy the records in the range of <scan> that are left in its current leaf,
+ * up to <max> of them, to <out>: the key of each one, as given to the index,
+ * then its value. Returns how many, or AME_ERROR (AME_EOF) at the end of the
+ * scan */
+static int scan_leaf(struct scan_entry *scan, struct file_entry *file,
+                     char *out, int max)
+{
+	BT_Leaf *leaf = scan_position(scan, file);
+	char key[BT_MAX_KEY];
+	void *value;
+	int last, head, n = 0;
 
-		BF_UnpinBlock(bl);                        // Unpin current_block
-		BF_Block_Destroy(&bl);                  // Cleanup before return
+	if (!leaf) {
+		return AME_ERROR;
+	}
+
+	last = scan->current_block == scan->end_block ? scan->end_entry :
+	       scan->step > 0 ? leaf->record_count - 1 : 0;
+
+	while (n < max && (last - scan->next_entry) * scan->step >= 0) {
+		leaf_key(file, leaf, scan->next_entry, key);
+
+		if ((head = leaf_posting(file, leaf, scan->next_entry))) {
+			value = posting_next(file, &scan->posting, head);
+
+			if (!value) {
+				scan->next_entry += scan->step;
+				continue;
+			}
+		} else {
+			value = record(file, leaf, scan->next_entry, 1);
+			scan->next_entry += scan->step;
+		}
+
+		denormalize_key(file, out, key);
+		memcpy(out + file->key_size, value, file->value_size);
+
+		out += file->record_size;
+		n++;
+	}
+
+	return n;
+}
+
+/* Are there records of the memtable left for <scan>? Walking left they are
+ * taken from mem_end down */
+static int scan_memtable(struct scan_entry *scan, struct file_entry *file)
+{
+	if (scan->step > 0 && scan->mem_next == scan->mem_skip) {
+		scan->mem_next = scan->mem_resume;
+	} else if (scan->step < 0 && scan->mem_end == scan->mem_resume) {
+		scan->mem_end = scan->mem_skip;
+	}
+
+	// A merge since the scan opened leaves nothing behind
+	if (scan->mem_end > file->memtable_count) {
+		scan->mem_end = file->memtable_count;
+	}
+
+	return scan->mem_next < scan->mem_end;
+}
+
+/* The next record of <scan>, with its key in <key> (if not NULL). Merges the
+ * records of the tree with those of the memtable, reading the tree one record
+ * ahead. On equal keys the tree goes first */
+static void *scan_next(struct scan_entry *scan, struct file_entry *file, void *key)
+{
+	void *found;
+	int memtable = scan_memtable(scan, file);
+	int mem = scan->step > 0 ? scan->mem_next : scan->mem_end - 1;
 
+	if (scan->tree_eof && !memtable) {
+		AM_errno = AME_EOF;
 		return NULL;
 	}
 
-	// Move on the the next leaf if we're through with this one
-	if (scan->next_entry == leaf->record_count) {
-		// Moving on to entry 0 of the next_block
-		scan->current_block = leaf->next_block;
-		scan->next_entry = 0;
-		BF_UnpinBlock(bl);
+	// Nothing more in the memtable: the tree as it is
+	if (!memtable && !scan->ahead) {
+		found = scan_tree(scan, file, key);
+		scan->tree_eof = !found && AM_errno == AME_EOF;
+
+		return found;
+	}
 
-		BF_Block_Destroy(&bl);                  // Cleanup before return
+	if (!scan->ahead && !scan->tree_eof) {
+		scan->ahead_value = scan_tree(scan, file, scan->ahead_key);
+		scan->ahead = scan->ahead_value != NULL;
 
-		/* Recursive call because we need to evaluate the new
-		 * parameters (e.g. whether we're done) */
-		return AM_FindNextEntry(scanDesc);
+		// A tree that cannot be read is not the end of it
+		if (!scan->ahead && AM_errno != AME_EOF) {
+			return NULL;
+		}
+
+		scan->tree_eof = !scan->ahead;
 	}
 
-	// Normal operation. Return current entry, increment counter
-	found = record(file, leaf, scan->next_entry, 1);
-	scan->next_entry++;
+	if (memtable &&
+	    (!scan->ahead ||
+	     compare_key(file, file->memtable_keys + (size_t) mem * file->key_size,
+	                 scan->ahead_key) * scan->step < 0)) {
+		if (key) {
+			memcpy(key, file->memtable_keys + (size_t) mem * file->key_size,
+			       file->key_size);
+		}
 
-	BF_Block_Destroy(&bl);
+		found = file->memtable_values + (size_t) mem * file->value_size;
 
-	return found;
+		if (scan->step > 0) {
+			scan->mem_next++;
+		} else {
+			scan->mem_end--;
+		}
+
+		return found;
+	}
+
+	if (key) {
+		memcpy(key, scan->ahead_key, file->key_size);
+	}
+
+	scan->ahead = 0;
+
+	return scan->ahead_value;
 }
 
-int AM_CloseIndexScan(int scanDesc)
+void *AM_FindNextEntry(int scanDesc)
+{
+	struct scan_entry *scan;
+
+	if (!valid_scand(scanDesc)) {
+		AM_errno = AME_INVALID_SCAND;
+		return NULL;
+	}
+
+	scan = open_scans.entry[scanDesc];
+
+	return scan_next(scan, open_files.entry[scan->fileDesc], NULL);
+}
+
+/* Whole leaves at a time, while the memtable has nothing in the way. Records
+ * of the memtable are merged in one by one, as AM_FindNextEntry does */
+int AM_FindNextBatch(int scanDesc, void *out, size_t max, size_t *n)
 {
 	struct scan_entry *scan;
 	struct file_entry *file;
-	BF_Block *bl;
+	char key[BT_MAX_KEY], *next;
+	void *value;
+	int count;
+
+	*n = 0;
 
 	if (!valid_scand(scanDesc)) {
 		AM_errno = AME_INVALID_SCAND;
@@ -672,21 +3954,71 @@ int AM_CloseIndexScan(int scanDesc)
 	}
 
 	scan = open_scans.entry[scanDesc];
+	file = open_files.entry[scan->fileDesc];
 
-	/* If the scan hasn't reached EOF, current_block is pinned (see README).
-	 * Free it */
-	if (!scan_done(scan)) {
-		file = open_files.entry[scan->fileDesc];
+	while (*n < max) {
+		next = (char *) out + *n * file->record_size;
 
-		BF_Block_Init(&bl);
+		if (!scan_memtable(scan, file) && !scan->ahead) {
+			if (scan->tree_eof) {
+				break;
+			}
 
-		CALL_BF(BF_GetBlock(file->fd, scan->current_block, bl));
-		CALL_BF(BF_UnpinBlock(bl));
+			count = scan_leaf(scan, file, next,
+			                  max - *n < INT_MAX ? (int) (max - *n) : INT_MAX);
+
+			if (count == AME_ERROR && AM_errno != AME_EOF) {
+				return AME_ERROR;
+			} else if (count == AME_ERROR) {
+				scan->tree_eof = 1;
+				break;
+			}
+
+			*n += count;
+			continue;
+		}
+
+		if (!(value = scan_next(scan, file, key))) {
+			break;
+		}
+
+		denormalize_key(file, next, key);
+		memcpy(next + file->key_size, value, file->value_size);
+		(*n)++;
+	}
+
+	if (!*n) {
+		AM_errno = AME_EOF;
+	}
+
+	return AME_OK;
+}
+
+int AM_CloseIndexScan(int scanDesc)
+{
+	struct scan_entry *scan;
+
+	if (!valid_scand(scanDesc)) {
+		AM_errno = AME_INVALID_SCAND;
+		return AME_ERROR;
+	}
 
-		BF_Block_Destroy(&bl);
+	scan = open_scans.entry[scanDesc];
+
+	// Leaves read in for nothing: closed early
+	if (scan->prefetched) {
+		scan->window = scan->window / 2 > READ_AHEAD_MIN ? scan->window / 2
+		                                                 : READ_AHEAD_MIN;
 	}
 
-	free(scan);
+	open_files.entry[scan->fileDesc]->read_ahead = scan->window;
+
+	// The leaf the scan is on, if any, is the only one pinned for it
+	scan_release(scan);
+
+	free(scan->list);
+	scan->list = NULL;
+
 	open_scans.entry[scanDesc] = NULL;
 	open_scans.count--;
 
@@ -734,6 +4066,27 @@ void AM_PrintError(char *errString)
 	case AME_NOT_A_BT_FILE:
 		info = "Requested file is not a B-Tree file.";
 		break;
+	case AME_INVALID_OPTION:
+		info = "Invalid option for this index.";
+		break;
+	case AME_INVALID_PAGE_SIZE:
+		info = "Invalid page size.";
+		break;
+	case AME_INVALID_FILL_FACTOR:
+		info = "Invalid fill factor.";
+		break;
+	case AME_NOT_FOUND:
+		info = "No such entry.";
+		break;
+	case AME_DUPLICATE_KEY:
+		info = "Key already in a unique index.";
+		break;
+	case AME_NOT_UNIQUE:
+		info = "Index keys are not unique.";
+		break;
+	case AME_REPLACE_ERROR:
+		info = "Couldn't replace file.";
+		break;
 	default:
 		return;
 	}
@@ -1,218 +1,1847 @@
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "bf.h"
+#include "PF.h"
 #include "BT.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BT_SIMD
+#endif
+
+#define CACHE_LINE 64
+#define VECTOR_WINDOW 64           // Keys left for the vector kernels to count
+#define PACKING_SIZE 2             // Prefix compressed block header (see below)
+
 // Small stack implementation
-struct stack_node {
-	int data;
-	struct stack_node *next;
-};
+void stack_push(struct stack *stack, int data)
+{
+	if (stack->count == STACK_DEPTH) {
+		fputs("stack: too deep.\n", stderr);
+		return;
+	}
+
+	stack->data[stack->count++] = data;
+}
+
+int stack_pop(struct stack *stack)
+{
+	if (!stack->count) {
+		return 0;
+	}
+
+	return stack->data[--stack->count];
+}
+
+// Key search helpers
+// Numeric value of a normalized 'i' or 'f' key, used to guess positions
+static double key_number(struct file_entry *file, void *key)
+{
+	float f;
+
+	if (file->header.field_type[0] == 'f') {
+		denormalize_key(file, &f, key);
+		return f;
+	}
+
+	return *(int *) key;
+}
+
+/* Narrow [*lo, *hi) by probing where <value> would sit if the keys were evenly
+ * spread between the two ends. Gives up as soon as a probe doesn't at least
+ * halve the range (skewed keys), or when the ends are too far apart for a
+ * finite guess ('f' keys of +-inf or NaN), leaving the rest to binary search */
+static void interpolate(struct file_entry *file, char *base, int stride,
+                        int *lo, int *hi, void *value, int upper)
+{
+	double first, last, target = key_number(file, value);
+	int pos, cmp, width;
+
+	while ((width = *hi - *lo) > 8) {
+		first = key_number(file, base + *lo * stride);
+		last = key_number(file, base + (*hi - 1) * stride);
+
+		if (!isfinite(last - first) || !isfinite(target)) {
+			return;
+		}
+
+		if (target <= first) {
+			pos = *lo;
+		} else if (target >= last) {
+			pos = *hi - 1;
+		} else {
+			pos = *lo + (int) ((target - first) / (last - first) *
+			                   (*hi - 1 - *lo));
+		}
+
+		cmp = file->compare(base + pos * stride, value, file->key_size);
+		if (cmp < 0 || (upper && cmp == 0)) {
+			*lo = pos + 1;
+		} else {
+			*hi = pos;
+		}
+
+		if (2 * (*hi - *lo) > width) {
+			break;
+		}
+	}
+}
+
+/* Return the index of the first of <n> keys (laid out <stride> bytes apart
+ * from <base>) that is greater than <value>, if <upper>, or greater than or
+ * equal to it otherwise. Returns n if there is no such key */
+int key_bound(struct file_entry *file, char *base, int stride, int n,
+              void *value, int upper)
+{
+	int lo = 0, hi = n, mid, cmp;
+
+	if ((file->header.flags & BT_INTERPOLATION_SEARCH) &&
+	    file->header.field_type[0] != 'c') {
+		interpolate(file, base, stride, &lo, &hi, value, upper);
+	}
+
+	/* Split layout: the keys are contiguous, so bisect down to a window
+	 * small enough to count with a few vector compares. Since the keys are
+	 * sorted, the number of keys before the bound is the bound itself.
+	 * (Buffered messages are keys with values, not contiguous) */
+	if (file->count_keys && stride == file->key_size) {
+		while (hi - lo > VECTOR_WINDOW) {
+			mid = lo + (hi - lo) / 2;
+			cmp = file->compare(base + mid * stride, value, file->key_size);
+
+			if (cmp < 0 || (upper && cmp == 0)) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		return lo + file->count_keys(base + lo * stride, hi - lo,
+		                             value, upper);
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = file->compare(base + mid * stride, value, file->key_size);
+
+		if (cmp < 0 || (upper && cmp == 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Key counting kernels for the split layout.
+ * Each returns how many of the <n> contiguous keys are < value (or <= value,
+ * if <upper>). Normalized 'f' keys compare as ints, so the same kernels serve
+ * both key types. bt_layout() picks the best one the CPU supports */
+static int count_int(const char *keys, int n, const void *value, int upper)
+{
+	const int *k = (const int *) keys, v = *(const int *) value;
+	int i, count = 0;
+
+	for (i = 0; i < n; ++i) {
+		count += upper ? k[i] <= v : k[i] < v;
+	}
+
+	return count;
+}
+
+#ifdef BT_SIMD
+static int count_int_sse2(const char *keys, int n, const void *value, int upper)
+{
+	const __m128i v = _mm_set1_epi32(*(const int *) value);
+	__m128i k, mask;
+	int i, count = 0;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		k = _mm_loadu_si128((const __m128i *) (keys + i * sizeof(int)));
+
+		// <= is "not >": count the keys past the bound and subtract
+		mask = upper ? _mm_cmpgt_epi32(k, v) : _mm_cmpgt_epi32(v, k);
+		count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(mask)));
+	}
+
+	if (upper) {
+		count = i - count;
+	}
+
+	return count + count_int(keys + i * sizeof(int), n - i, value, upper);
+}
+
+__attribute__((target("avx2")))
+static int count_int_avx2(const char *keys, int n, const void *value, int upper)
+{
+	const __m256i v = _mm256_set1_epi32(*(const int *) value);
+	__m256i k, mask;
+	int i, count = 0;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		k = _mm256_loadu_si256((const __m256i *) (keys + i * sizeof(int)));
+		mask = upper ? _mm256_cmpgt_epi32(k, v) : _mm256_cmpgt_epi32(v, k);
+		count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+	}
+
+	if (upper) {
+		count = i - count;
+	}
+
+	return count + count_int_sse2(keys + i * sizeof(int), n - i, value, upper);
+}
+
+#endif
+
+static int align_up(int n, int to)
+{
+	return (n + to - 1) / to * to;
+}
+
+/* With BT_MESSAGE_BUFFERS a node keeps about the square root of the keys that
+ * would fit, so that each child gets a fair share of a buffer that takes the
+ * rest of the page */
+static int buffered_keys(struct file_entry *file, int n)
+{
+	int root = 2;
+
+	if (!(file->header.flags & BT_MESSAGE_BUFFERS)) {
+		return n;
+	}
+
+	while ((root + 1) * (root + 1) <= n) {
+		root++;
+	}
+
+	return root < n ? root : n;
+}
+
+// The message buffer of a node starts past its last key and pointer
+static void buffer_layout(struct file_entry *file)
+{
+	int keys_end, pointers_end;
+
+	if (!(file->header.flags & BT_MESSAGE_BUFFERS)) {
+		file->buffer_offset = 0;
+		file->max_messages = 0;
+		return;
+	}
+
+	keys_end = file->node_keys.offset +
+	           (file->max_keys - 1) * file->node_keys.stride + file->key_size;
+	pointers_end = file->node_pointers.offset +
+	               file->max_keys * file->node_pointers.stride + sizeof(int);
+
+	file->buffer_offset = align_up(keys_end > pointers_end ? keys_end : pointers_end,
+	                               sizeof(int));
+	file->max_messages = (file->pf.page_size - file->buffer_offset -
+	                      (int) sizeof(int)) / file->record_size;
+}
+
+// Order of normalized 'i' and 'f' keys (see normalize_key)
+static int compare_int(const void *key, const void *value, size_t size)
+{
+	const int a = *(const int *) key, b = *(const int *) value;
+
+	(void) size;
+
+	return (a > b) - (a < b);
+}
+
+void bt_layout(struct file_entry *file)
+{
+	const int key_size = file->header.field_length[0],
+	          value_size = file->header.field_length[1];
+	int n;
+
+	file->key_size = key_size;
+	file->value_size = value_size;
+	file->record_size = key_size + value_size;
+	file->posting_tag = 0;
+	file->max_run = 0;
+
+	// Normalized strings are zero-padded, so plain memcmp orders them
+	file->compare = file->header.field_type[0] == 'c' ? memcmp : compare_int;
+
+	if (file->header.flags & BT_PREFIX_COMPRESSION) {
+		/* Same as the default layout, after a packing header (see
+		 * Prefix compressed blocks). A full block must split into two
+		 * halves that still take a key of any length each, so the
+		 * entries are capped at twice as many as fit uncompressed */
+		file->max_keys = 2 * ((file->pf.page_size - sizeof(BT_Node) -
+		                       PACKING_SIZE - sizeof(int)) /
+		                      (key_size + sizeof(int))) - 2;
+		file->max_records = 2 * ((file->pf.page_size - sizeof(BT_Leaf) -
+		                          PACKING_SIZE) /
+		                         (key_size + value_size)) - 2;
+		file->count_keys = NULL;
+
+		buffer_layout(file);
+		return;
+	}
+
+	if (!(file->header.flags & BT_SPLIT_LAYOUT)) {
+		/* | pointer | key | pointer | key | ... | pointer |
+		 * | [key value] | [key value] | ... */
+		file->node_pointers.offset = offsetof(BT_Node, array);
+		file->node_pointers.stride = sizeof(int) + key_size;
+		file->node_keys.offset = offsetof(BT_Node, array) + sizeof(int);
+		file->node_keys.stride = sizeof(int) + key_size;
+
+		file->leaf_keys.offset = offsetof(BT_Leaf, records);
+		file->leaf_keys.stride = key_size + value_size;
+		file->leaf_values.offset = offsetof(BT_Leaf, records) + key_size;
+		file->leaf_values.stride = key_size + value_size;
+
+		file->max_keys = buffered_keys(file, (file->pf.page_size -
+		                                      sizeof(BT_Node) - sizeof(int)) /
+		                                     (key_size + sizeof(int)));
+		file->max_records = (file->pf.page_size - sizeof(BT_Leaf)) /
+		                    (key_size + value_size);
+		file->count_keys = NULL;
+
+		/* | [key value tag (pad)] | ... A value slot can take the first
+		 * page of a posting list instead. The padding keeps 'i'/'f' keys
+		 * and values int aligned */
+		if (file->header.flags & BT_POSTING_LISTS) {
+			file->posting_tag = key_size + (value_size > (int) sizeof(int) ?
+			                                value_size : (int) sizeof(int));
+			file->leaf_keys.stride = align_up(file->posting_tag + 1,
+			                                  sizeof(int));
+			file->leaf_values.stride = file->leaf_keys.stride;
+			file->max_records = (file->pf.page_size - sizeof(BT_Leaf)) /
+			                    file->leaf_keys.stride;
+			file->max_run = file->max_records / 4 > 2 ?
+			                file->max_records / 4 : 2;
+		}
+
+		buffer_layout(file);
+		return;
+	}
+
+	/* | pointer | pointer | ... | pointer | (pad) | key | key | ... | key |
+	 * | value | value | ... | value | (pad) | key | key | ... | key |
+	 * The pointers/values go first so that the keys can start on a cache
+	 * line without wasting more than its remainder */
+	n = (file->pf.page_size - sizeof(BT_Node) - sizeof(int)) / (key_size + sizeof(int));
+	while (align_up(sizeof(BT_Node) + (n + 1) * sizeof(int), CACHE_LINE) +
+	       n * key_size > file->pf.page_size) {
+		n--;
+	}
+
+	n = buffered_keys(file, n);
+
+	file->max_keys = n;
+	file->node_pointers.offset = offsetof(BT_Node, array);
+	file->node_pointers.stride = sizeof(int);
+	file->node_keys.offset = align_up(sizeof(BT_Node) + (n + 1) * sizeof(int),
+	                                  CACHE_LINE);
+	file->node_keys.stride = key_size;
+
+	n = (file->pf.page_size - sizeof(BT_Leaf)) / (key_size + value_size);
+	while (align_up(sizeof(BT_Leaf) + n * value_size, CACHE_LINE) +
+	       n * key_size > file->pf.page_size) {
+		n--;
+	}
+
+	file->max_records = n;
+	file->leaf_values.offset = offsetof(BT_Leaf, records);
+	file->leaf_values.stride = value_size;
+	file->leaf_keys.offset = align_up(sizeof(BT_Leaf) + n * value_size,
+	                                  CACHE_LINE);
+	file->leaf_keys.stride = key_size;
+
+	buffer_layout(file);
+
+	file->count_keys = count_int;
+
+#ifdef BT_SIMD
+	if (__builtin_cpu_supports("avx2")) {
+		file->count_keys = count_int_avx2;
+	} else {
+		file->count_keys = count_int_sse2;
+	}
+#endif
+}
+
+// Prefix compressed blocks
+/* With BT_PREFIX_COMPRESSION ('c' keys) a block starts with a packing header,
+ * followed by its entries in the default layout:
+ * | prefix length | width | prefix | entries ...
+ * Every key in the block starts with the prefix and is zero past prefix + width
+ * bytes, so an entry only stores the <width> bytes in between. A block is
+ * repacked when a key comes in that doesn't fit its packing, and after a split,
+ * where each half may have more in common than the whole */
+static int packed(struct file_entry *file)
+{
+	return file->header.flags & BT_PREFIX_COMPRESSION;
+}
+
+static unsigned char *packing(void *block)
+{
+	if (((BT_Node *) block)->is_leaf) {
+		return (unsigned char *) ((BT_Leaf *) block)->records;
+	}
+
+	return (unsigned char *) ((BT_Node *) block)->array;
+}
+
+static char *packed_entries(void *block)
+{
+	unsigned char *pk = packing(block);
+
+	return (char *) pk + PACKING_SIZE + pk[0];
+}
+
+// Bytes of each key that <block> stores
+static int key_width(struct file_entry *file, void *block)
+{
+	return packed(file) ? packing(block)[1] : file->key_size;
+}
+
+static int entries(void *block)
+{
+	if (((BT_Node *) block)->is_leaf) {
+		return ((BT_Leaf *) block)->record_count;
+	}
+
+	return ((BT_Node *) block)->key_count;
+}
+
+// Length of a normalized string key, without the zero padding
+static int key_length(struct file_entry *file, const char *key)
+{
+	return strnlen(key, file->key_size);
+}
+
+// Rebuild a full key from what <block> stores of it
+static void unpack_key(struct file_entry *file, void *block, const char *stored,
+                       char *dst)
+{
+	const unsigned char *pk = packing(block);
+
+	if (!packed(file)) {
+		memcpy(dst, stored, file->key_size);
+		return;
+	}
+
+	memcpy(dst, pk + PACKING_SIZE, pk[0]);
+	memcpy(dst + pk[0], stored, pk[1]);
+	memset(dst + pk[0] + pk[1], 0, file->key_size - pk[0] - pk[1]);
+}
+
+/* Packing of <block> once <key> joins it: the prefix shrinks to what the key
+ * shares with it and the width grows to cover the rest of the key */
+static void packing_with(struct file_entry *file, void *block, const char *key,
+                         int *prefix, int *width)
+{
+	const unsigned char *pk = packing(block);
+	int length = key_length(file, key), end = pk[0] + pk[1];
+
+	if (!entries(block)) {
+		*prefix = length;
+		*width = 0;
+		return;
+	}
+
+	*prefix = 0;
+	while (*prefix < pk[0] && key[*prefix] == pk[PACKING_SIZE + *prefix]) {
+		(*prefix)++;
+	}
+
+	*width = (length > end ? length : end) - *prefix;
+}
+
+// Can <block> take one more entry, for <key>, within its page?
+static int packed_room(struct file_entry *file, void *block, const char *key)
+{
+	int prefix, width, n = entries(block) + 1, size;
+
+	packing_with(file, block, key, &prefix, &width);
+
+	if (((BT_Node *) block)->is_leaf) {
+		size = offsetof(BT_Leaf, records) + PACKING_SIZE + prefix +
+		       n * (width + file->value_size);
+	} else {
+		size = offsetof(BT_Node, array) + PACKING_SIZE + prefix +
+		       (n + 1) * sizeof(int) + n * width;
+	}
+
+	return size <= file->pf.page_size;
+}
+
+/* Rewrite <block> under a new packing that still covers all of its keys,
+ * taking the prefix bytes from the full key <from> */
+static void repack(struct file_entry *file, void *block, const char *from,
+                   int prefix, int width)
+{
+	BT_Node *old = (BT_Node *) file->scratch;
+	unsigned char *pk = packing(block);
+	char full[BT_MAX_KEY];
+	int i;
+
+	memcpy(old, block, file->pf.page_size);
+
+	pk[0] = prefix;
+	pk[1] = width;
+	memcpy(pk + PACKING_SIZE, from, prefix);
+
+	if (!old->is_leaf) {
+		*pointer(file, block, 0) = *pointer(file, old, 0);
+
+		for (i = 0; i < old->key_count; ++i) {
+			node_key(file, old, i, full);
+			memcpy(key(file, block, i), full + prefix, width);
+			*pointer(file, block, i + 1) = *pointer(file, old, i + 1);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < ((BT_Leaf *) old)->record_count; ++i) {
+		leaf_key(file, (BT_Leaf *) old, i, full);
+		memcpy(record(file, block, i, 0), full + prefix, width);
+		memcpy(record(file, block, i, 1),
+		       record(file, (BT_Leaf *) old, i, 1),
+		       file->value_size);
+	}
+}
+
+// Repack <block>, if needed, so that <key> can be written in it
+static void pack_for(struct file_entry *file, void *block, const char *key)
+{
+	const unsigned char *pk = packing(block);
+	int prefix, width;
+
+	packing_with(file, block, key, &prefix, &width);
+
+	// An emptied block may still hold the prefix of keys it no longer has
+	if (!entries(block) || prefix != pk[0] || width != pk[1]) {
+		repack(file, block, key, prefix, width);
+	}
+}
+
+// Repack <block> as tightly as the keys left in it allow
+static void pack_tight(struct file_entry *file, void *block)
+{
+	char first[BT_MAX_KEY], full[BT_MAX_KEY];
+	int i, n = entries(block), prefix = 0, longest = 0, length;
+
+	for (i = 0; i < n; ++i) {
+		if (((BT_Node *) block)->is_leaf) {
+			leaf_key(file, block, i, full);
+		} else {
+			node_key(file, block, i, full);
+		}
+
+		if (!i) {
+			memcpy(first, full, file->key_size);
+		}
+
+		length = key_length(file, full);
+		if (length > longest) {
+			longest = length;
+		}
+	}
+
+	// The keys are sorted: what the first and the last share, all of them do
+	while (n && prefix < longest && first[prefix] == full[prefix]) {
+		prefix++;
+	}
+
+	repack(file, block, first, prefix, longest - prefix);
+}
+
+/* Would the entries of <left> and <right>, and <sep> between them (nodes: the
+ * key pulled down from the parent, NULL for leaves), fit in one prefix
+ * compressed block? Packed as tightly as pack_tight() would */
+static int packed_join_fit(struct file_entry *file, void *left, void *sep,
+                           void *right)
+{
+	const int leaf = ((BT_Node *) left)->is_leaf;
+	char first[BT_MAX_KEY], full[BT_MAX_KEY];
+	int part, i, count, n = 0, prefix = 0, longest = 0, length;
+	void *block;
+	size_t size;
+
+	// Their keys in order: <left>, <sep>, <right>
+	for (part = 0; part < 3; ++part) {
+		block = part ? right : left;
+		count = part == 1 ? sep != NULL : entries(block);
+
+		for (i = 0; i < count; ++i, ++n) {
+			if (part == 1) {
+				memcpy(full, sep, file->key_size);
+			} else if (leaf) {
+				leaf_key(file, block, i, full);
+			} else {
+				node_key(file, block, i, full);
+			}
+
+			if (!n) {
+				memcpy(first, full, file->key_size);
+			}
+
+			length = key_length(file, full);
+			if (length > longest) {
+				longest = length;
+			}
+		}
+	}
+
+	while (n && prefix < longest && first[prefix] == full[prefix]) {
+		prefix++;
+	}
+
+	if (leaf) {
+		size = offsetof(BT_Leaf, records) + PACKING_SIZE + prefix +
+		       n * (longest - prefix + file->value_size);
+	} else {
+		size = offsetof(BT_Node, array) + PACKING_SIZE + prefix +
+		       (n + 1) * sizeof(int) + n * (longest - prefix);
+	}
+
+	return n <= (leaf ? file->max_records : file->max_keys) &&
+	       size <= (size_t) file->pf.page_size;
+}
+
+/* key_bound() over the keys of a prefix compressed block. <value> is compared
+ * with the prefix once, then only with the stored part of each key */
+static int packed_bound(struct file_entry *file, void *block, char *base,
+                        int stride, int n, void *value, int upper)
+{
+	const unsigned char *pk = packing(block);
+	const int prefix = pk[0], width = pk[1];
+	const char *v = value;
+	int lo = 0, hi = n, mid, cmp, longer;
+
+	if ((cmp = memcmp(v, pk + PACKING_SIZE, prefix))) {
+		return cmp < 0 ? 0 : n;         // Before or after all the keys
+	}
+
+	/* A key that matches all of <value> it stores is smaller, if <value>
+	 * goes on past that: the key is zero there */
+	longer = key_length(file, v) > prefix + width;
+	v += prefix;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		cmp = memcmp(base + mid * stride, v, width);
+		if (!cmp && longer) {
+			cmp = -1;
+		}
+
+		if (cmp < 0 || (upper && cmp == 0)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+
+// B-Tree Node Methods
+int *pointer(struct file_entry *file, BT_Node *node, int i)
+{
+	if (packed(file)) {
+		return (int *) (packed_entries(node) +
+		                i * (sizeof(int) + key_width(file, node)));
+	}
+
+	return (int *) ((char *) node + file->node_pointers.offset +
+	                i * file->node_pointers.stride);
+}
+
+void *key(struct file_entry *file, BT_Node *node, int i)
+{
+	if (packed(file)) {
+		return (char *) pointer(file, node, i) + sizeof(int);
+	}
+
+	return (char *) node + file->node_keys.offset + i * file->node_keys.stride;
+}
+
+void node_key(struct file_entry *file, BT_Node *node, int i, void *dst)
+{
+	unpack_key(file, node, key(file, node, i), dst);
+}
+
+// Store <value> as key i (its packed part, if prefix compressed)
+void set_key(struct file_entry *file, BT_Node *node, int i, void *value)
+{
+	const int from = packed(file) ? packing(node)[0] : 0;
+
+	memcpy(key(file, node, i), (char *) value + from, key_width(file, node));
+}
+
+/* Move <n> (key, right pointer) pairs, starting at key <from> of <src>, to
+ * key <to> of <dst>. The ranges may overlap. Prefix compressed blocks must
+ * have the same packing */
+static void move_keys(struct file_entry *file, BT_Node *dst, int to,
+                      BT_Node *src, int from, int n)
+{
+	const int key_size = file->key_size;
+
+	if (!(file->header.flags & BT_SPLIT_LAYOUT)) {
+		// Each key is followed by its right pointer
+		memmove(key(file, dst, to),
+		        key(file, src, from),
+		        n * (key_width(file, src) + sizeof(int)));
+		return;
+	}
+
+	memmove(key(file, dst, to), key(file, src, from), n * key_size);
+	memmove(pointer(file, dst, to + 1),
+	        pointer(file, src, from + 1),
+	        n * sizeof(int));
+}
+
+int node_full(struct file_entry *file, BT_Node *node, void *key)
+{
+	if (node->key_count == file->max_keys) {
+		return 1;
+	}
+
+	return packed(file) && !packed_room(file, node, key);
+}
+
+/* Split points
+ * A split leaves header.fill_factor percent of the entries of a block where
+ * they are (half if 0) and moves the rest to the new block, as long as the new
+ * entry falls on the smaller side. On the larger one it would fill its block
+ * up again, and the next insert there would split every level above: such a
+ * block splits in half. With BT_ADAPTIVE_SPLIT, a leaf where the last few
+ * inserts each went next to the one before (ascending keys, descending keys,
+ * a hot spot) splits at the new key instead: the records on the far side of
+ * it are not getting any more company, so they may as well stay in a full
+ * block */
+
+// Inserts in a row next to each other that make a leaf's inserts skewed
+#define SKEWED_RUN 4
+
+/* Entries a block of <count> keeps in a split, by the fill factor, with the
+ * new entry going in at <at> */
+static int split_share(struct file_entry *file, int count, int at)
+{
+	int fill = file->header.fill_factor ? file->header.fill_factor : 50;
+	int keep = count * fill / 100;
+
+	if (keep > count - 1) {
+		keep = count - 1;
+	}
+
+	if (keep < 1 && count > 1) {
+		keep = 1;
+	}
+
+	if ((at < keep) == (keep > count - keep)) {
+		return count / 2;
+	}
+
+	return keep;
+}
+
+static struct bt_history *history(struct file_entry *file, int page)
+{
+	return &file->history[page % BT_HISTORY];
+}
+
+void bt_note_insert(struct file_entry *file, int page, int i)
+{
+	struct bt_history *h = history(file, page);
+
+	if (!(file->header.flags & BT_ADAPTIVE_SPLIT)) {
+		return;
+	}
+
+	// Ascending keys go right after the last one, descending ones at it
+	if (h->page == page && i >= h->last - 1 && i <= h->last + 1) {
+		h->run++;
+	} else {
+		h->page = page;
+		h->run = 0;
+	}
+
+	h->last = i;
+}
+
+static int skewed(struct file_entry *file, int page)
+{
+	const struct bt_history *h = history(file, page);
+
+	return file->header.flags & BT_ADAPTIVE_SPLIT &&
+	       h->page == page && h->run >= SKEWED_RUN;
+}
+
+int split_node(struct file_entry *file, BT_Node *node, void *key, void *key_up)
+{
+	PF_Page *new = file->split_page;
+	BT_Node *left;
+	int new_block_pos;
+	int mid, from;
+
+	bt_allocate(file, new, &new_block_pos);
+	left = (BT_Node *) PF_Page_GetData(new);
+
+	// The key past the share of the node that stays goes up
+	mid = split_share(file, node->key_count, node_find(file, node, key));
+	node_key(file, node, mid, key_up);
+
+	/* Split the keys before and after <mid> between the new nodes.
+	 * | pointer | key | pointer | key | pointer | key | pointer |
+	 * | --------- node ---------> UP^ | --------- left ---------> */
+	left->key_count = node->key_count - mid - 1;     // 1 key lost (goes up)
+	node->key_count = mid;
+
+	// Copy over the required amount of (key, pointer) pairs
+	if (packed(file)) {
+		memcpy(packing(left), packing(node), PACKING_SIZE + packing(node)[0]);
+	}
+
+	*pointer(file, left, 0) = *pointer(file, node, mid + 1);
+	move_keys(file, left, 0, node, mid + 1, left->key_count);
+
+	// Buffered messages go along with the keys that lead to them
+	if (file->header.flags & BT_MESSAGE_BUFFERS) {
+		from = message_bound(file, node, key_up, 0);
+
+		*message_count(file, left) = *message_count(file, node) - from;
+		memcpy(message(file, left, 0, 0), message(file, node, from, 0),
+		       *message_count(file, left) * file->record_size);
+		*message_count(file, node) = from;
+	}
+
+	if (packed(file)) {
+		pack_tight(file, node);
+		pack_tight(file, left);
+	}
+
+	PF_Page_SetDirty(new);
+	PF_UnpinPage(new);
+
+	return new_block_pos;
+}
+
+int *message_count(struct file_entry *file, BT_Node *node)
+{
+	return (int *) ((char *) node + file->buffer_offset);
+}
+
+void *message(struct file_entry *file, BT_Node *node, int i, int field)
+{
+	return (char *) node + file->buffer_offset + sizeof(int) +
+	       i * file->record_size + (field ? file->key_size : 0);
+}
+
+int message_bound(struct file_entry *file, BT_Node *node, void *value, int upper)
+{
+	return key_bound(file, message(file, node, 0, 0), file->record_size,
+	                 *message_count(file, node), value, upper);
+}
+
+void buffer_message(struct file_entry *file, BT_Node *node, void *key, void *value)
+{
+	int *count = message_count(file, node),
+	    pos = message_bound(file, node, key, 1);
+
+	memmove(message(file, node, pos + 1, 0), message(file, node, pos, 0),
+	        (*count - pos) * file->record_size);
+	memcpy(message(file, node, pos, 0), key, file->key_size);
+	memcpy(message(file, node, pos, 1), value, file->value_size);
+	(*count)++;
+}
+
+void unbuffer_messages(struct file_entry *file, BT_Node *node, int from, int to)
+{
+	int *count = message_count(file, node);
+
+	memmove(message(file, node, from, 0), message(file, node, to, 0),
+	        (*count - to) * file->record_size);
+	*count -= to - from;
+}
+
+void remove_key(struct file_entry *file, BT_Node *node, int i)
+{
+	remove_keys(file, node, i, i + 1);
+}
+
+void remove_keys(struct file_entry *file, BT_Node *node, int from, int to)
+{
+	move_keys(file, node, from, node, to, node->key_count - to);
+	node->key_count -= to - from;
+}
+
+/* Move the first <n> children of <right> to the end of <left>, through the
+ * key <sep> between them in the parent, which becomes the key before the
+ * first child left in <right>. Messages go along with the children */
+static void rotate_left(struct file_entry *file, BT_Node *left, BT_Node *right,
+                        int n, char *sep)
+{
+	const int count = left->key_count;
+	int from;
+
+	set_key(file, left, count, sep);
+	*pointer(file, left, count + 1) = *pointer(file, right, 0);
+	move_keys(file, left, count + 1, right, 0, n - 1);
+	left->key_count += n;
+
+	memcpy(sep, key(file, right, n - 1), file->key_size);
+	*pointer(file, right, 0) = *pointer(file, right, n);
+	move_keys(file, right, 0, right, n, right->key_count - n);
+	right->key_count -= n;
+
+	if (file->header.flags & BT_MESSAGE_BUFFERS) {
+		from = message_bound(file, right, sep, 0);
+
+		memcpy(message(file, left, *message_count(file, left), 0),
+		       message(file, right, 0, 0), from * file->record_size);
+		*message_count(file, left) += from;
+		unbuffer_messages(file, right, 0, from);
+	}
+}
+
+// The other way round: the last <n> children of <left> to the front of <right>
+static void rotate_right(struct file_entry *file, BT_Node *left, BT_Node *right,
+                         int n, char *sep)
+{
+	const int count = left->key_count, first = *pointer(file, right, 0);
+	int from, moved;
+
+	move_keys(file, right, n, right, 0, right->key_count);
+	*pointer(file, right, n) = first;
+	set_key(file, right, n - 1, sep);
+	move_keys(file, right, 0, left, count - n + 1, n - 1);
+	*pointer(file, right, 0) = *pointer(file, left, count - n + 1);
+	right->key_count += n;
+
+	memcpy(sep, key(file, left, count - n), file->key_size);
+	left->key_count -= n;
+
+	if (file->header.flags & BT_MESSAGE_BUFFERS) {
+		from = message_bound(file, left, sep, 0);
+		moved = *message_count(file, left) - from;
+
+		memmove(message(file, right, moved, 0), message(file, right, 0, 0),
+		        *message_count(file, right) * file->record_size);
+		memcpy(message(file, right, 0, 0), message(file, left, from, 0),
+		       moved * file->record_size);
+		*message_count(file, right) += moved;
+		*message_count(file, left) = from;
+	}
+}
+
+int join_nodes(struct file_entry *file, BT_Node *left, BT_Node *right, void *sep)
+{
+	const int buffered = file->header.flags & BT_MESSAGE_BUFFERS;
+	const int total = left->key_count + right->key_count;
+	char full[BT_MAX_KEY];
+	int i, n, moved;
+
+	// Merge, with <sep> pulled down between them
+	if (packed(file) ? packed_join_fit(file, left, sep, right)
+	                 : total + 1 <= file->max_keys &&
+	                   (!buffered || *message_count(file, left) +
+	                    *message_count(file, right) <= file->max_messages)) {
+		if (packed(file)) {
+			pack_tight(file, left);
+			insert_node_nonfull(file, left, sep, *pointer(file, right, 0));
+
+			for (i = 0; i < right->key_count; ++i) {
+				node_key(file, right, i, full);
+				insert_node_nonfull(file, left, full,
+				                    *pointer(file, right, i + 1));
+			}
+
+			right->key_count = 0;
+			return 1;
+		}
+
+		set_key(file, left, left->key_count, sep);
+		*pointer(file, left, left->key_count + 1) = *pointer(file, right, 0);
+		move_keys(file, left, left->key_count + 1, right, 0, right->key_count);
+		left->key_count = total + 1;
+		right->key_count = 0;
+
+		if (buffered) {
+			memcpy(message(file, left, *message_count(file, left), 0),
+			       message(file, right, 0, 0),
+			       *message_count(file, right) * file->record_size);
+			*message_count(file, left) += *message_count(file, right);
+			*message_count(file, right) = 0;
+		}
+
+		return 1;
+	}
+
+	// Packed keys in the parent might not fit a new separator
+	if (packed(file)) {
+		return -1;
+	}
+
+	/* Half each. The new key between them decides what messages go with
+	 * the children that move, and they must fit */
+	n = total / 2 - left->key_count;
+
+	if (n > 0) {
+		if (buffered) {
+			moved = message_bound(file, right, key(file, right, n - 1), 0);
+			if (*message_count(file, left) + moved > file->max_messages) {
+				return -1;
+			}
+		}
+
+		rotate_left(file, left, right, n, sep);
+	} else if (n < 0) {
+		if (buffered) {
+			moved = *message_count(file, left) -
+			        message_bound(file, left, key(file, left, left->key_count + n), 0);
+			if (*message_count(file, right) + moved > file->max_messages) {
+				return -1;
+			}
+		}
+
+		rotate_right(file, left, right, -n, sep);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+// Find index of <value> key in node. (i = 0 .. key_count - 1)
+// First key greater than <value> (upper), or not less than it
+static int node_bound(struct file_entry *file, BT_Node *node, void *value,
+                      int upper)
+{
+	if (packed(file)) {
+		return packed_bound(file, node, key(file, node, 0),
+		                    sizeof(int) + key_width(file, node),
+		                    node->key_count, value, upper);
+	}
+
+	return key_bound(file, key(file, node, 0), file->node_keys.stride,
+	                 node->key_count, value, upper);
+}
+
+int node_find(struct file_entry *file, BT_Node *node, void *value)
+{
+	// First key greater than <value>. Equal keys send us to the right.
+	return node_bound(file, node, value, 1);
+}
+
+int node_find_first(struct file_entry *file, BT_Node *node, void *value)
+{
+	return node_bound(file, node, value, 0);
+}
+
+// This function assumes a non-full block (used by insert_leaf_nonfull after all)
+void shift_keys(struct file_entry *file, BT_Node *node, int i)
+{
+	// Move (key, pointer) pairs one to the right
+	move_keys(file, node, i + 1, node, i, node->key_count - i);
+}
+
+void insert_node_nonfull(struct file_entry *file, BT_Node *node, void *key, int right)
+{
+	int i;
+
+	if (packed(file)) {
+		pack_for(file, node, key);
+	}
+
+	i = node_find(file, node, key);
+
+	shift_keys(file, node, i);
+	set_key(file, node, i, key);
+	*pointer(file, node, i + 1) = right;
+	node->key_count++;
+}
+
+void insert_node_after(struct file_entry *file, BT_Node *node, int left,
+                       void *key, int right)
+{
+	char equal[BT_MAX_KEY];
+	int i, at;
+
+	if (packed(file)) {
+		pack_for(file, node, key);
+	}
+
+	i = at = node_find(file, node, key);
+
+	// Back over the keys equal to <key>, to the pointer to <left>
+	while (at > 0 && *pointer(file, node, at) != left) {
+		node_key(file, node, at - 1, equal);
+		if (compare_key(file, equal, key)) {
+			break;
+		}
+
+		at--;
+	}
+
+	if (*pointer(file, node, at) == left) {
+		i = at;
+	}
+
+	shift_keys(file, node, i);
+	set_key(file, node, i, key);
+	*pointer(file, node, i + 1) = right;
+	node->key_count++;
+}
+
+int node_child(struct file_entry *file, BT_Node *node, int page)
+{
+	int i;
+
+	for (i = 0; i <= node->key_count; ++i) {
+		if (*pointer(file, node, i) == page) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+// Free list
+BF_ErrorCode bt_allocate(struct file_entry *file, PF_Page *page, int *page_num)
+{
+	BF_ErrorCode code;
+	char *data;
+
+	if (!file->header.free_head && !file->header.free_leaves) {
+		code = PF_GetPageCounter(&file->pf, page_num);
+		return code == BF_OK ? PF_AllocatePage(&file->pf, page) : code;
+	}
+
+	*page_num = file->header.free_head ? file->header.free_head
+	                                   : file->header.free_leaves;
+
+	code = PF_GetPage(&file->pf, *page_num, page);
+	if (code != BF_OK) {
+		return code;
+	}
+
+	// As a new page would be
+	data = PF_Page_GetData(page);
+
+	if (file->header.free_head) {
+		memcpy(&file->header.free_head, data, sizeof(int));
+	} else {
+		file->header.free_leaves = ((BT_Leaf *) data)->next_block;
+	}
+
+	memset(data, 0, file->pf.page_size);
+
+	PF_Page_SetDirty(page);
+
+	return BF_OK;
+}
+
+void bt_free(struct file_entry *file, PF_Page *page, int page_num)
+{
+	memcpy(PF_Page_GetData(page), &file->header.free_head, sizeof(int));
+	file->header.free_head = page_num;
+
+	PF_Page_SetDirty(page);
+	PF_UnpinPage(page);
+}
+
+
+// B-Tree Leaf Methods
+BT_Leaf *create_leaf(struct file_entry *file, PF_Page **bl, int *page_num)
+{
+	BT_Leaf *leaf;
+
+	bt_allocate(file, *bl, page_num);
+	leaf = (BT_Leaf *) PF_Page_GetData(*bl);
+
+	leaf->is_leaf = 1;
+
+	PF_Page_SetDirty(*bl);
+
+	return leaf;
+}
+
+void link_prev(struct file_entry *file, int page, int prev)
+{
+	PF_Page *bl = file->search_page;
+
+	if (!page) {
+		return;
+	}
+
+	PF_GetPage(&file->pf, page, bl);
+	((BT_Leaf *) PF_Page_GetData(bl))->prev_block = prev;
+
+	PF_Page_SetDirty(bl);
+	PF_UnpinPage(bl);
+}
+
+void *record(struct file_entry *file, BT_Leaf *leaf, int i, int field)
+{
+	const struct bt_array *array = field ? &file->leaf_values : &file->leaf_keys;
+	char *entry;
+
+	if (packed(file)) {
+		entry = packed_entries(leaf) +
+		        i * (key_width(file, leaf) + file->value_size);
+
+		return field ? entry + key_width(file, leaf) : entry;
+	}
+
+	return (char *) leaf + array->offset + i * array->stride;
+}
+
+void leaf_key(struct file_entry *file, BT_Leaf *leaf, int i, void *dst)
+{
+	unpack_key(file, leaf, record(file, leaf, i, 0), dst);
+}
+
+/* Move <n> records, starting at record <from> of <src>, to record <to> of
+ * <dst>. The ranges may overlap. Prefix compressed blocks must have the same
+ * packing */
+static void move_records(struct file_entry *file, BT_Leaf *dst, int to,
+                         BT_Leaf *src, int from, int n)
+{
+	if (packed(file)) {
+		memmove(record(file, dst, to, 0),
+		        record(file, src, from, 0),
+		        n * (key_width(file, src) + file->value_size));
+		return;
+	} else if (!(file->header.flags & BT_SPLIT_LAYOUT)) {
+		memmove(record(file, dst, to, 0), record(file, src, from, 0),
+		        n * file->leaf_keys.stride);
+		return;
+	}
+
+	memmove(record(file, dst, to, 0), record(file, src, from, 0),
+	        n * file->key_size);
+	memmove(record(file, dst, to, 1), record(file, src, from, 1),
+	        n * file->value_size);
+}
+
+void set_record(struct file_entry *file, BT_Leaf *leaf, int i, void *value1, void *value2)
+{
+	const int from = packed(file) ? packing(leaf)[0] : 0;
+
+	memcpy(record(file, leaf, i, 0), (char *) value1 + from,
+	       key_width(file, leaf));
+	memcpy(record(file, leaf, i, 1), value2, file->value_size);
+
+	if (file->posting_tag) {
+		((char *) record(file, leaf, i, 0))[file->posting_tag] = 0;
+	}
+}
+
+// Posting lists
+int leaf_posting(struct file_entry *file, BT_Leaf *leaf, int i)
+{
+	int head;
+
+	if (!file->posting_tag ||
+	    !((char *) record(file, leaf, i, 0))[file->posting_tag]) {
+		return 0;
+	}
+
+	memcpy(&head, record(file, leaf, i, 1), sizeof(head));
+
+	return head;
+}
+
+/* Would <key> go into a posting list in <leaf>, one it has or one its run is
+ * long enough to turn into? If so, <last> is the run's last record */
+static int posting_takes(struct file_entry *file, BT_Leaf *leaf, void *key,
+                         int *last)
+{
+	char found[BT_MAX_KEY];
+	int i = leaf_find_last(file, leaf, key);
+
+	if (i < 0) {
+		return 0;
+	}
+
+	leaf_key(file, leaf, i, found);
+	if (compare_key(file, found, key)) {
+		return 0;
+	}
+
+	if (last) {
+		*last = i;
+	}
+
+	return leaf_posting(file, leaf, i) ||
+	       i + 1 - leaf_find_first(file, leaf, key) >= file->max_run;
+}
+
+static char *posting_last(BT_Posting *page)
+{
+	return page->data;
+}
+
+static unsigned char *posting_values(struct file_entry *file, BT_Posting *page)
+{
+	return (unsigned char *) page->data + file->value_size;
+}
+
+// Bytes for the values of a page
+static int posting_room(struct file_entry *file)
+{
+	return file->pf.page_size - sizeof(BT_Posting) - file->value_size;
+}
+
+static int posting_compare(struct file_entry *file, const void *a, const void *b)
+{
+	int x, y;
+
+	if (file->header.field_type[1] != 'i') {
+		return memcmp(a, b, file->value_size);
+	}
+
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+
+	return (x > y) - (x < y);
+}
+
+/* Write <value> after <prev> (NULL for the first value of a page) to <dst>.
+ * An 'i' value after another is the difference, 7 bits a byte, the high bit
+ * set on all bytes but the last. Anything else is stored as is. Returns the
+ * bytes written */
+static int posting_encode(struct file_entry *file, unsigned char *dst,
+                          const void *prev, const void *value)
+{
+	unsigned int delta;
+	int x, y, n = 0;
+
+	if (!prev || file->header.field_type[1] != 'i') {
+		memcpy(dst, value, file->value_size);
+		return file->value_size;
+	}
+
+	memcpy(&x, prev, sizeof(x));
+	memcpy(&y, value, sizeof(y));
+	delta = (unsigned int) y - (unsigned int) x;
+
+	while (delta >= 0x80) {
+		dst[n++] = delta | 0x80;
+		delta >>= 7;
+	}
+
+	dst[n++] = delta;
+
+	return n;
+}
+
+// The other way round: the value at <src> into <value>. Returns the bytes read
+static int posting_decode(struct file_entry *file, const unsigned char *src,
+                          const void *prev, void *value)
+{
+	unsigned int delta = 0;
+	int x, n = 0, shift = 0;
+
+	if (!prev || file->header.field_type[1] != 'i') {
+		memcpy(value, src, file->value_size);
+		return file->value_size;
+	}
+
+	do {
+		delta |= (unsigned int) (src[n] & 0x7f) << shift;
+		shift += 7;
+	} while (src[n++] & 0x80);
+
+	memcpy(&x, prev, sizeof(x));
+	x = (int) ((unsigned int) x + delta);
+	memcpy(value, &x, sizeof(x));
+
+	return n;
+}
+
+/* Fill <page> with values [from, to) of the <src> values, which must fit.
+ * Storing the first one as is, they may take more bytes than they did in <src>,
+ * but no more than a single value */
+static void posting_fill(struct file_entry *file, BT_Posting *page,
+                         const unsigned char *src, int from, int to)
+{
+	char prev[BT_MAX_KEY], value[BT_MAX_KEY];
+	unsigned char *dst = posting_values(file, page);
+	int i, in = 0, out = 0;
+
+	for (i = 0; i < to; ++i) {
+		in += posting_decode(file, src + in, i ? prev : NULL, value);
+
+		if (i >= from) {
+			out += posting_encode(file, dst + out, i > from ? prev : NULL, value);
+		}
+
+		memcpy(prev, value, file->value_size);
+	}
+
+	page->count = to - from;
+	page->used = out;
+
+	if (to > from) {
+		memcpy(posting_last(page), prev, file->value_size);
+	}
+}
+
+/* Put <value> in <page> (pinned in posting_page), in order after any equal
+ * ones. The values are rewritten in posting_scratch first; if they don't fit,
+ * the page splits in two, in half or, for a value at the end of the list, just
+ * past the old values. Returns the new page, if it is the new tail, or else 0 */
+static int posting_put(struct file_entry *file, BT_Posting *page, void *value)
+{
+	unsigned char *src = posting_values(file, page);
+	unsigned char *dst = (unsigned char *) file->posting_scratch;
+	char prev[BT_MAX_KEY], current[BT_MAX_KEY];
+	BT_Posting *new;
+	int i, in = 0, out = 0, n = 0, at = page->count, mid, new_pos, tail;
+
+	for (i = 0; i <= page->count; ++i) {
+		if (i < page->count) {
+			in += posting_decode(file, src + in, i ? current : NULL, current);
+		}
+
+		if (at == page->count &&
+		    (i == page->count || posting_compare(file, value, current) < 0)) {
+			out += posting_encode(file, dst + out, n ? prev : NULL, value);
+			memcpy(prev, value, file->value_size);
+			at = n++;
+		}
+
+		if (i < page->count) {
+			out += posting_encode(file, dst + out, n ? prev : NULL, current);
+			memcpy(prev, current, file->value_size);
+			n++;
+		}
+	}
+
+	if (out <= posting_room(file)) {
+		memcpy(src, dst, out);
+		page->count = n;
+		page->used = out;
+		memcpy(posting_last(page), prev, file->value_size);
+
+		return 0;
+	}
+
+	tail = !page->next;
+	mid = tail && at == n - 1 ? n - 1 : n / 2;
+
+	bt_allocate(file, file->posting_other, &new_pos);
+	new = (BT_Posting *) PF_Page_GetData(file->posting_other);
+
+	new->next = page->next;
+	page->next = new_pos;
+
+	posting_fill(file, new, dst, mid, n);
+	posting_fill(file, page, dst, 0, mid);
+
+	PF_Page_SetDirty(file->posting_other);
+	PF_UnpinPage(file->posting_other);
+
+	return tail ? new_pos : 0;
+}
+
+// A new, empty list. Returns its first page
+static int posting_create(struct file_entry *file)
+{
+	BT_Posting *page;
+	int pos;
+
+	bt_allocate(file, file->posting_page, &pos);
+	page = (BT_Posting *) PF_Page_GetData(file->posting_page);
+	page->tail = pos;
+
+	PF_Page_SetDirty(file->posting_page);
+	PF_UnpinPage(file->posting_page);
+
+	return pos;
+}
+
+void posting_insert(struct file_entry *file, int head, void *value)
+{
+	PF_Page *bl = file->posting_page;
+	BT_Posting *page;
+	int pos = head, tail;
+
+	/* Values in ascending order go to the tail. Others walk the chain to
+	 * the first page that ends past them */
+	PF_GetPage(&file->pf, head, bl);
+	page = (BT_Posting *) PF_Page_GetData(bl);
+	tail = page->tail;
+
+	if (tail != head) {
+		PF_UnpinPage(bl);
+		PF_GetPage(&file->pf, tail, bl);
+		page = (BT_Posting *) PF_Page_GetData(bl);
+
+		if (posting_compare(file, value, posting_last(page)) >= 0) {
+			pos = tail;
+		} else {
+			PF_UnpinPage(bl);
+			PF_GetPage(&file->pf, head, bl);
+			page = (BT_Posting *) PF_Page_GetData(bl);
+		}
+	}
+
+	while (pos != tail && page->count &&
+	       posting_compare(file, value, posting_last(page)) > 0) {
+		pos = page->next;
+		PF_UnpinPage(bl);
+		PF_GetPage(&file->pf, pos, bl);
+		page = (BT_Posting *) PF_Page_GetData(bl);
+	}
+
+	tail = posting_put(file, page, value);
+
+	PF_Page_SetDirty(bl);
+	PF_UnpinPage(bl);
+
+	if (tail) {
+		PF_GetPage(&file->pf, head, bl);
+		((BT_Posting *) PF_Page_GetData(bl))->tail = tail;
+		PF_Page_SetDirty(bl);
+		PF_UnpinPage(bl);
+	}
+}
 
-void stack_push(struct stack_node **top, int data)
+// Drop the values equal to <value> from <page>. Returns how many went
+static int posting_drop(struct file_entry *file, BT_Posting *page, void *value)
 {
-	struct stack_node *temp = malloc(sizeof(*temp));
+	unsigned char *src = posting_values(file, page);
+	unsigned char *dst = (unsigned char *) file->posting_scratch;
+	char prev[BT_MAX_KEY], current[BT_MAX_KEY];
+	int i, in = 0, out = 0, n = 0, removed;
 
-	if (!temp) {
-		fputs("stack_node: malloc failed.\n", stderr);
-		return;
+	for (i = 0; i < page->count; ++i) {
+		in += posting_decode(file, src + in, i ? current : NULL, current);
+
+		if (!posting_compare(file, value, current)) {
+			continue;
+		}
+
+		out += posting_encode(file, dst + out, n ? prev : NULL, current);
+		memcpy(prev, current, file->value_size);
+		n++;
+	}
+
+	removed = page->count - n;
+
+	// Never longer than before: a delta takes no more than the two it joins
+	memcpy(src, dst, out);
+	page->count = n;
+	page->used = out;
+
+	if (n) {
+		memcpy(posting_last(page), prev, file->value_size);
 	}
 
-	// temp is the new top
-	temp->data = data;
-	temp->next = *top;
-	*top = temp;
+	return removed;
 }
 
-int stack_pop(struct stack_node **top)
+int posting_remove(struct file_entry *file, int head, void *value)
 {
-	struct stack_node *temp;
-	int data;
+	PF_Page *bl = file->posting_page, *other = file->posting_other;
+	BT_Posting *page;
+	int pos = head, prev = 0, removed = 0, tail, following;
+
+	if (!value) {
+		while (pos) {
+			PF_GetPage(&file->pf, pos, bl);
+			page = (BT_Posting *) PF_Page_GetData(bl);
+			following = page->next;
+			removed += page->count;
+
+			bt_free(file, bl, pos);
+			pos = following;
+		}
 
-	if (!*top) {
-		return 0;
+		return removed;
 	}
 
-	data = (*top)->data;
+	PF_GetPage(&file->pf, head, bl);
+	page = (BT_Posting *) PF_Page_GetData(bl);
+	tail = page->tail;
 
-	temp = *top;
-	*top = (*top)->next;
-	free(temp);
+	for (;;) {
+		following = page->next;
 
-	return data;
-}
+		// Pages that end before <value> are skipped
+		if (!page->count ||
+		    posting_compare(file, value, posting_last(page)) <= 0) {
+			removed += posting_drop(file, page, value);
+			PF_Page_SetDirty(bl);
+		}
 
-void stack_destroy(struct stack_node **top)
-{
-	while (stack_pop(top)) {
-		continue;
-	};
-}
+		/* An emptied page leaves the chain. The first one takes the
+		 * place of the next, if any, and is looked at again */
+		if (!page->count && following && pos == head) {
+			PF_GetPage(&file->pf, following, other);
+			memcpy(page, PF_Page_GetData(other), file->pf.page_size);
+			page->tail = tail = following == tail ? head : tail;
+			bt_free(file, other, following);
+			continue;
+		} else if (!page->count && pos != head) {
+			bt_free(file, bl, pos);
+
+			PF_GetPage(&file->pf, prev, bl);
+			page = (BT_Posting *) PF_Page_GetData(bl);
+			page->next = following;
+
+			if (pos == tail) {
+				tail = prev;
+				PF_GetPage(&file->pf, head, other);
+				((BT_Posting *) PF_Page_GetData(other))->tail = tail;
+				PF_Page_SetDirty(other);
+				PF_UnpinPage(other);
+			}
+
+			PF_Page_SetDirty(bl);
+			pos = prev;
+		}
 
-// B-Tree Node Methods
-int *pointer(struct file_entry *file, BT_Node *node, int i)
-{
-	const int key_size = file->header.field_length[0];
-	return (int *) (node->array + i * (sizeof(int) + key_size));
-}
+		// The rest of the chain is past <value>
+		if (!following || (page->count &&
+		                   posting_compare(file, value, posting_last(page)) < 0)) {
+			break;
+		}
 
-void *key(struct file_entry *file, BT_Node *node, int i)
-{
-	// i-th key is adjacent to the i-th pointer
-	return pointer(file, node, i) + 1;
-}
+		prev = pos;
+		pos = following;
+		PF_UnpinPage(bl);
+		PF_GetPage(&file->pf, pos, bl);
+		page = (BT_Posting *) PF_Page_GetData(bl);
+	}
 
-void set_key(struct file_entry *file, BT_Node *node, int i, void *value)
-{
-	const int key_size = file->header.field_length[0];
-	memcpy(key(file, node, i), value, key_size);
-}
+	PF_UnpinPage(bl);
 
-/* Calculates how many (key, value) pairs can fit in a node.
- * This depends only on the attribute sizes for this BT File */
-int max_key_count(struct file_entry *file)
-{
-	const int key_size = file->header.field_length[0];
-	return (BF_BLOCK_SIZE - sizeof(BT_Node) - sizeof(int)) /
-	       (key_size + sizeof(int));
+	return removed;
 }
 
-int node_full(struct file_entry *file, BT_Node *node)
+int posting_empty(struct file_entry *file, int head)
 {
-	return node->key_count == max_key_count(file);
+	int empty;
+
+	PF_GetPage(&file->pf, head, file->posting_page);
+	empty = !((BT_Posting *) PF_Page_GetData(file->posting_page))->count;
+	PF_UnpinPage(file->posting_page);
+
+	return empty;
 }
 
-int split_node(struct file_entry *file, BT_Node *node, void *key_up)
+void *posting_next(struct file_entry *file, struct bt_posting_cursor *cursor,
+                   int head)
 {
-	BF_Block *new;
-	BT_Node *left;
-	int new_block_pos;
-	int mid;
-	const int key_size = file->header.field_length[0];
+	PF_Page *bl = file->posting_page;
+	BT_Posting *page;
 
-	BF_Block_Init(&new);
+	if (!cursor->page) {
+		cursor->page = head;
+		cursor->entry = 0;
+		cursor->offset = 0;
+	}
 
-	BF_GetBlockCounter(file->fd, &new_block_pos);
+	for (;;) {
+		PF_GetPage(&file->pf, cursor->page, bl);
+		page = (BT_Posting *) PF_Page_GetData(bl);
 
-	BF_AllocateBlock(file->fd, new);
-	left = (BT_Node *) BF_Block_GetData(new);
+		if (cursor->entry < page->count) {
+			cursor->offset += posting_decode(file, posting_values(file, page) +
+			                                       cursor->offset,
+			                                 cursor->entry ? cursor->value : NULL,
+			                                 cursor->value);
+			cursor->entry++;
 
-	// The middle key goes up
-	mid = node->key_count / 2;
-	memcpy(key_up, key(file, node, mid), key_size);
+			PF_UnpinPage(bl);
+			return cursor->value;
+		}
 
-	/* Split the keys before and after <mid> between the new nodes.
-	 * | pointer | key | pointer | key | pointer | key | pointer |
-	 * | --------- node ---------> UP^ | --------- left ---------> */
-	left->key_count = node->key_count - mid - 1;     // 1 key lost (goes up)
-	node->key_count = mid;
+		cursor->page = page->next;
+		cursor->entry = 0;
+		cursor->offset = 0;
+		PF_UnpinPage(bl);
 
-	// Copy over the required amount of (key, pointer) pairs
-	*pointer(file, left, 0) = *pointer(file, node, mid + 1);
-	memcpy(key(file, left, 0),
-	       key(file, node, mid + 1),
-	       left->key_count * (key_size + sizeof(int)));
+		if (!cursor->page) {
+			return NULL;
+		}
+	}
+}
 
-	BF_Block_SetDirty(new);
-	BF_UnpinBlock(new);
+/* Record <i> of <leaf> ends a run of <key> that goes into a posting list (see
+ * posting_takes): add <value2> to it, making it first if need be, from the
+ * run. Returns the position of the record that stands for the list */
+static int posting_add(struct file_entry *file, BT_Leaf *leaf, int i, void *key,
+                       void *value2)
+{
+	int head = leaf_posting(file, leaf, i), first, j;
 
-	BF_Block_Destroy(&new);
+	if (!head) {
+		first = leaf_find_first(file, leaf, key);
+		head = posting_create(file);
 
-	return new_block_pos;
-}
+		for (j = first; j <= i; ++j) {
+			posting_insert(file, head, record(file, leaf, j, 1));
+		}
 
-// Find index of <value> key in node. (i = 0 .. key_count - 1)
-int node_find(struct file_entry *file, BT_Node *node, void *value)
-{
-	int i = 0;
+		remove_records(file, leaf, first + 1, i + 1);
+		i = first;
 
-	while (i < node->key_count &&
-	       compare_key(file, key(file, node, i), value) <= 0) {
-		i++;
+		memcpy(record(file, leaf, i, 1), &head, sizeof(head));
+		((char *) record(file, leaf, i, 0))[file->posting_tag] = 1;
 	}
 
+	posting_insert(file, head, value2);
+
 	return i;
 }
 
-// This function assumes a non-full block (used by insert_leaf_nonfull after all)
-void shift_keys(struct file_entry *file, BT_Node *node, int i)
+int remove_values(struct file_entry *file, BT_Leaf *leaf, int from, int to,
+                  void *value2)
 {
-	const int key_size = file->header.field_length[0];
+	int i, head, removed = 0;
+
+	for (i = to - 1; i >= from; --i) {
+		head = leaf_posting(file, leaf, i);
+
+		// A list left empty goes with its record
+		if (head && value2) {
+			removed += posting_remove(file, head, value2);
+
+			if (!posting_empty(file, head)) {
+				continue;
+			}
+
+			posting_remove(file, head, NULL);
+		} else if (head) {
+			removed += posting_remove(file, head, NULL);
+		} else if (!value2 ||
+		           !memcmp(record(file, leaf, i, 1), value2, file->value_size)) {
+			removed++;
+		} else {
+			continue;
+		}
 
-	// Move (key, pointer) pairs one to the right
-	memmove(key(file, node, i + 1),
-	        key(file, node, i),
-	        (node->key_count - i) * (key_size + sizeof(int)));
+		// Without <value2> the records go all at once, below
+		if (value2) {
+			remove_records(file, leaf, i, i + 1);
+		}
+	}
+
+	if (!value2) {
+		remove_records(file, leaf, from, to);
+	}
+
+	return removed;
 }
 
-void insert_node_nonfull(struct file_entry *file, BT_Node *node, void *key, int right)
+int leaf_full(struct file_entry *file, BT_Leaf *leaf, void *key)
 {
-	int i = node_find(file, node, key);
+	// A key with a posting list, or about to get one, takes no room
+	if (leaf->record_count == file->max_records) {
+		return !file->max_run || !posting_takes(file, leaf, key, NULL);
+	}
 
-	shift_keys(file, node, i);
-	set_key(file, node, i, key);
-	*pointer(file, node, i + 1) = right;
-	node->key_count++;
+	return packed(file) && !packed_room(file, leaf, key);
 }
 
+// Separator for a split of <leaf> at <pivot>, in <sep> (see separator_key)
+static void separator(struct file_entry *file, BT_Leaf *leaf, int pivot, char *sep)
+{
+	char last[BT_MAX_KEY];
 
-// B-Tree Leaf Methods
-BT_Leaf *create_leaf(int fd, BF_Block **bl)
+	leaf_key(file, leaf, pivot, sep);
+
+	if (pivot) {
+		leaf_key(file, leaf, pivot - 1, last);
+		separator_key(file, last, sep);
+	}
+}
+
+/* Would records [from, to) of <leaf> and <key> fit in one prefix compressed
+ * leaf? Their prefix is what every one of them shares with <key> */
+static int packed_fit(struct file_entry *file, BT_Leaf *leaf, int from, int to,
+                      const char *key)
 {
-	BT_Leaf *leaf;
+	char full[BT_MAX_KEY];
+	int i, j, prefix = file->key_size, longest = key_length(file, key), length;
 
-	BF_AllocateBlock(fd, *bl);
-	leaf = (BT_Leaf *) BF_Block_GetData(*bl);
+	for (i = from; i < to; ++i) {
+		leaf_key(file, leaf, i, full);
 
-	leaf->is_leaf = 1;
+		for (j = 0; j < prefix && full[j] == key[j]; ++j) {
+			continue;
+		}
 
-	BF_Block_SetDirty(*bl);
+		prefix = j;
+		length = key_length(file, full);
+		if (length > longest) {
+			longest = length;
+		}
+	}
 
-	return leaf;
+	if (prefix > longest) {
+		prefix = longest;
+	}
+
+	return to - from < file->max_records &&
+	       offsetof(BT_Leaf, records) + PACKING_SIZE + prefix +
+	       (to - from + 1) * (longest - prefix + file->value_size) <=
+	       (size_t) file->pf.page_size;
 }
 
-void *record(struct file_entry *file, BT_Leaf *leaf, int i, int field)
+/* Splitting at <pivot>, would the side <key> goes to still have room for it?
+ * The new leaf mustn't be empty */
+static int split_room(struct file_entry *file, BT_Leaf *leaf, int pivot, void *key)
 {
-	const int field0_size = file->header.field_length[0],
-	          record_size = field0_size + file->header.field_length[1];
+	char sep[BT_MAX_KEY];
+	int right;
 
-	return leaf->records + i * record_size + field * field0_size;
-}
+	if (pivot == leaf->record_count) {
+		return 0;
+	}
 
-void set_record(struct file_entry *file, BT_Leaf *leaf, int i, void *value1, void *value2)
-{
-	memcpy(record(file, leaf, i, 0), value1, file->header.field_length[0]);
-	memcpy(record(file, leaf, i, 1), value2, file->header.field_length[1]);
-}
+	separator(file, leaf, pivot, sep);
+	right = compare_key(file, sep, key) <= 0;
 
-int max_record_count(struct file_entry *file)
-{
-	const int record_size = file->header.field_length[0]
-	                      + file->header.field_length[1];
-	return (BF_BLOCK_SIZE - sizeof(BT_Leaf)) / record_size;
-}
+	if (packed(file)) {
+		return right ? packed_fit(file, leaf, pivot, leaf->record_count, key)
+		             : packed_fit(file, leaf, 0, pivot, key);
+	}
 
-int leaf_full(struct file_entry *file, BT_Leaf *leaf)
-{
-	return leaf->record_count == max_record_count(file);
+	return (right ? leaf->record_count - pivot : pivot) < file->max_records;
 }
 
-int split_leaf(struct file_entry *file, BT_Leaf *leaf, void *key_up)
+int split_leaf(struct file_entry *file, BT_Leaf *leaf, int page, void *key,
+               void *key_up)
 {
-	BF_Block *new;
+	PF_Page *new = file->split_page;
 	BT_Leaf *left;
-	void *mid;
-	int new_block_pos, pivot;
-	const int record_size = file->header.field_length[0]
-	                      + file->header.field_length[1];
-
-	BF_Block_Init(&new);
-
-	BF_GetBlockCounter(file->fd, &new_block_pos);
+	char mid[BT_MAX_KEY];
+	int new_block_pos, pivot, append, skew, at;
+
+	/* Appending past the end of the data list (ascending keys): nothing
+	 * more is coming to this leaf, so it stays full. The same goes for
+	 * the end of any leaf under skewed inserts */
+	skew = skewed(file, page);
+	leaf_key(file, leaf, leaf->record_count - 1, mid);
+	append = (!leaf->next_block || skew) && compare_key(file, mid, key) < 0;
+
+	// Skewed inserts: the split goes where the new record does
+	at = leaf_find_last(file, leaf, key) + 1;
+	if (skew && !append && !split_room(file, leaf, at, key)) {
+		skew = 0;
+	}
 
-	left = create_leaf(file->fd, &new);
+	left = create_leaf(file, &new, &new_block_pos);
 
 	/* If this is the rightmost leaf (next_block is 0), after the split the
 	 * new leaf is the end of the data list */
@@ -222,7 +1851,9 @@ int split_leaf(struct file_entry *file, BT_Leaf *leaf, void *key_up)
 
 	// Add new node to data block linked list
 	left->next_block = leaf->next_block;
+	left->prev_block = page;
 	leaf->next_block = new_block_pos;
+	link_prev(file, left->next_block, new_block_pos);
 
 	/* Split the records before and after <pivot> between the new leaves.
 	 * pivot is the index of the first record with key equal to that of mid.
@@ -230,108 +1861,449 @@ int split_leaf(struct file_entry *file, BT_Leaf *leaf, void *key_up)
 	 *                   <   mid  >
 	 * | [0, x] | [3, y] | [4, z] | [4, c] | [5, v] |
 	 * | ----- leaf -----> | -------- left --------> */
-	mid = record(file, leaf, leaf->record_count / 2, 0);   // middle element
-	pivot = leaf_find_first(file, leaf, mid);
+	if (append) {
+		// The new leaf starts with <key>, after the last record (mid)
+		pivot = leaf->record_count;
+		memcpy(key_up, key, file->key_size);
+		separator_key(file, mid, key_up);
+	} else if (skew) {
+		pivot = at;
+		separator(file, leaf, pivot, key_up);
+	} else {
+		// The element past the share of the leaf that stays
+		leaf_key(file, leaf, split_share(file, leaf->record_count, at), mid);
+		pivot = leaf_find_first(file, leaf, mid);
+
+		/* A long run of equal keys may leave no room for <key> on its
+		 * side. Then try splitting after the run, or cut it as a last
+		 * resort */
+		if (!split_room(file, leaf, pivot, key)) {
+			pivot = leaf_find_last(file, leaf, mid) + 1;
+
+			if (!split_room(file, leaf, pivot, key)) {
+				pivot = leaf->record_count / 2;
+			}
+		}
+
+		// Set <key_up> for caller
+		separator(file, leaf, pivot, key_up);
+	}
 
 	// Anything after the index <pivot> must go to the right now.
+	if (packed(file)) {
+		memcpy(packing(left), packing(leaf), PACKING_SIZE + packing(leaf)[0]);
+	}
+
 	left->record_count = leaf->record_count - pivot;
-	memcpy(record(file, left, 0, 0),
-	       record(file, leaf, pivot, 0),
-	       left->record_count * record_size);
+	move_records(file, left, 0, leaf, pivot, left->record_count);
 
 	leaf->record_count = pivot;
 
-	// Set <key_up> for caller
-	memcpy(key_up, record(file, left, 0, 0), file->header.field_length[0]);
+	if (packed(file)) {
+		pack_tight(file, leaf);
+		pack_tight(file, left);
+	}
 
-	BF_Block_SetDirty(new);
-	BF_UnpinBlock(new);
+	// A run of inserts carries on into the new leaf, if <key> goes there
+	if (file->header.flags & BT_ADAPTIVE_SPLIT &&
+	    history(file, page)->page == page &&
+	    compare_key(file, key_up, key) <= 0) {
+		*history(file, new_block_pos) = *history(file, page);
+		history(file, new_block_pos)->page = new_block_pos;
+		history(file, new_block_pos)->last = at - pivot;
+	}
 
-	BF_Block_Destroy(&new);
+	PF_Page_SetDirty(new);
+	PF_UnpinPage(new);
 
 	// Return pointer to new block for caller
 	return new_block_pos;
 }
 
-int leaf_find_first(struct file_entry *file, BT_Leaf *leaf, void *value)
+/* <pivot> of <leaf> moved to the nearer end of the run of equal keys it cuts,
+ * if any, so that the run stays in one leaf. -1 if the run is the whole leaf */
+static int run_boundary(struct file_entry *file, BT_Leaf *leaf, int pivot)
 {
-	int pos = 0;
+	char mid[BT_MAX_KEY];
+	int first, last;
 
-	while (pos < leaf->record_count &&
-	       compare_key(file, record(file, leaf, pos, 0), value) < 0) {
-		++pos;
+	if (pivot <= 0 || pivot >= leaf->record_count) {
+		return pivot;
 	}
 
-	return pos;
+	leaf_key(file, leaf, pivot, mid);
+	first = leaf_find_first(file, leaf, mid);
+	last = leaf_find_last(file, leaf, mid) + 1;
+
+	if (first == pivot) {
+		return pivot;
+	} else if (first > 0 &&
+	           (pivot - first <= last - pivot || last == leaf->record_count)) {
+		return first;
+	} else if (last < leaf->record_count) {
+		return last;
+	}
+
+	return -1;
 }
 
-int leaf_find_last(struct file_entry *file, BT_Leaf *leaf, void *value)
+/* Neighbouring leaves <left> and <right> are taken as one run of records:
+ * record i is in <left> if i < left->record_count, else in <right> */
+
+// <cut> in the pair moved off any run of equal keys (-1 if it can't be)
+static int pair_boundary(struct file_entry *file, BT_Leaf *left, BT_Leaf *right,
+                         int cut)
+{
+	int boundary;
+
+	if (cut <= left->record_count) {
+		return run_boundary(file, left, cut);
+	}
+
+	boundary = run_boundary(file, right, cut - left->record_count);
+
+	return boundary < 0 ? -1 : left->record_count + boundary;
+}
+
+// Separator for a cut of the pair at <boundary>, in <sep>
+static void pair_separator(struct file_entry *file, BT_Leaf *left, BT_Leaf *right,
+                           int boundary, char *sep)
+{
+	char last[BT_MAX_KEY];
+
+	if (boundary < left->record_count) {
+		separator(file, left, boundary, sep);
+		return;
+	}
+
+	leaf_key(file, right, boundary - left->record_count, sep);
+
+	if (boundary > left->record_count) {
+		leaf_key(file, right, boundary - left->record_count - 1, last);
+	} else {
+		leaf_key(file, left, boundary - 1, last);
+	}
+
+	separator_key(file, last, sep);
+}
+
+// Move records across the boundary of the pair, so that <left> has <boundary>
+static void pair_move(struct file_entry *file, BT_Leaf *left, BT_Leaf *right,
+                      int boundary)
+{
+	const int n = boundary - left->record_count;
+
+	if (n > 0) {
+		move_records(file, left, left->record_count, right, 0, n);
+		move_records(file, right, 0, right, n, right->record_count - n);
+	} else if (n < 0) {
+		move_records(file, right, -n, right, 0, right->record_count);
+		move_records(file, right, 0, left, boundary, -n);
+	}
+
+	left->record_count = boundary;
+	right->record_count -= n;
+}
+
+int share_leaves(struct file_entry *file, BT_Leaf *left, BT_Leaf *right,
+                 void *key, void *sep)
+{
+	const int total = left->record_count + right->record_count;
+	int boundary, right_side;
+
+	if (left->record_count == right->record_count) {
+		return 0;
+	}
+
+	/* Half each, counting <key>. At least one record moves off the
+	 * fuller leaf */
+	boundary = pair_boundary(file, left, right,
+	                         left->record_count > right->record_count ?
+	                         total / 2 : (total + 1) / 2);
+
+	if (boundary <= 0 || boundary >= total ||
+	    boundary == left->record_count) {
+		return 0;
+	}
+
+	pair_separator(file, left, right, boundary, sep);
+	right_side = compare_key(file, sep, key) <= 0;
+
+	if (boundary + !right_side > file->max_records ||
+	    total - boundary + right_side > file->max_records) {
+		return 0;
+	}
+
+	pair_move(file, left, right, boundary);
+
+	return 1;
+}
+
+int split_leaves(struct file_entry *file, BT_Leaf *left, BT_Leaf *right,
+                 void *key, void *sep_low, void *sep_high)
+{
+	PF_Page *new = file->split_page;
+	BT_Leaf *middle;
+	const int total = left->record_count + right->record_count;
+	int low, high, side, new_block_pos;
+
+	// A third each, with the middle leaf taking the ends of both
+	low = pair_boundary(file, left, right, total / 3);
+	high = pair_boundary(file, left, right, total - total / 3);
+
+	if (low <= 0 || high >= total || low >= high ||
+	    low > left->record_count || high < left->record_count) {
+		return 0;
+	}
+
+	pair_separator(file, left, right, low, sep_low);
+	pair_separator(file, left, right, high, sep_high);
+
+	// Room for <key>: side 0, 1, 2 is left, middle, right
+	side = compare_key(file, sep_low, key) > 0 ? 0 :
+	       compare_key(file, sep_high, key) > 0 ? 1 : 2;
+
+	if (low + (side == 0) > file->max_records ||
+	    high - low + (side == 1) > file->max_records ||
+	    total - high + (side == 2) > file->max_records) {
+		return 0;
+	}
+
+	middle = create_leaf(file, &new, &new_block_pos);
+
+	// In the data list between the two
+	middle->next_block = left->next_block;
+	middle->prev_block = right->prev_block;
+	left->next_block = new_block_pos;
+	right->prev_block = new_block_pos;
+
+	middle->record_count = 0;
+	pair_move(file, middle, right, high - left->record_count);
+	pair_move(file, left, middle, low);
+
+	PF_Page_SetDirty(new);
+	PF_UnpinPage(new);
+
+	return new_block_pos;
+}
+
+void remove_records(struct file_entry *file, BT_Leaf *leaf, int from, int to)
+{
+	move_records(file, leaf, from, leaf, to, leaf->record_count - to);
+	leaf->record_count -= to - from;
+}
+
+int join_leaves(struct file_entry *file, BT_Leaf *left, BT_Leaf *right, void *sep)
+{
+	const int total = left->record_count + right->record_count;
+	char full[BT_MAX_KEY];
+	int i, boundary;
+
+	// Merge
+	if (packed(file) ? packed_join_fit(file, left, NULL, right)
+	                 : total <= file->max_records) {
+		if (packed(file)) {
+			pack_tight(file, left);
+
+			for (i = 0; i < right->record_count; ++i) {
+				leaf_key(file, right, i, full);
+				insert_leaf_nonfull(file, left, full,
+				                    record(file, right, i, 1));
+			}
+
+			right->record_count = 0;
+		} else {
+			pair_move(file, left, right, total);
+		}
+
+		left->next_block = right->next_block;
+		link_prev(file, right->next_block, right->prev_block);
+		return 1;
+	}
+
+	// Packed keys in the parent might not fit a new separator
+	if (packed(file)) {
+		return -1;
+	}
+
+	// Half each, as share_leaves() does
+	boundary = pair_boundary(file, left, right, total / 2);
+
+	if (boundary <= 0 || boundary >= total ||
+	    boundary == left->record_count ||
+	    boundary > file->max_records || total - boundary > file->max_records) {
+		return -1;
+	}
+
+	pair_separator(file, left, right, boundary, sep);
+	pair_move(file, left, right, boundary);
+
+	return 0;
+}
+
+int leaf_find_first(struct file_entry *file, BT_Leaf *leaf, void *value)
 {
-	int pos = 0;
+	// First record with key >= value
+	if (packed(file)) {
+		return packed_bound(file, leaf, record(file, leaf, 0, 0),
+		                    key_width(file, leaf) + file->value_size,
+		                    leaf->record_count, value, 0);
+	}
+
+	return key_bound(file, record(file, leaf, 0, 0), file->leaf_keys.stride,
+	                 leaf->record_count, value, 0);
+}
 
-	while (pos < leaf->record_count &&
-	       compare_key(file, record(file, leaf, pos, 0), value) <= 0) {
-		++pos;
+int leaf_find_last(struct file_entry *file, BT_Leaf *leaf, void *value)
+{
+	// Last record with key <= value (one before the first greater one)
+	if (packed(file)) {
+		return packed_bound(file, leaf, record(file, leaf, 0, 0),
+		                    key_width(file, leaf) + file->value_size,
+		                    leaf->record_count, value, 1) - 1;
 	}
 
-	return (int) pos - 1;
+	return key_bound(file, record(file, leaf, 0, 0), file->leaf_keys.stride,
+	                 leaf->record_count, value, 1) - 1;
 }
 
 void shift_records(struct file_entry *file, BT_Leaf *leaf, int i)
 {
-	const int record_size = file->header.field_length[0]
-	                      + file->header.field_length[1];
-	memmove(record(file, leaf, i + 1, 0),
-	        record(file, leaf, i, 0),
-	        (leaf->record_count - i) * record_size);
+	move_records(file, leaf, i + 1, leaf, i, leaf->record_count - i);
 }
 
-void insert_leaf_nonfull(struct file_entry *file, BT_Leaf *leaf, void *value1, void *value2)
+int insert_leaf_nonfull(struct file_entry *file, BT_Leaf *leaf, void *value1, void *value2)
 {
-	int pos = (int) (leaf_find_last(file, leaf, value1) + 1);
+	char last[BT_MAX_KEY];
+	int pos;
+
+	if (packed(file)) {
+		pack_for(file, leaf, value1);
+	}
+
+	pos = leaf_find_last(file, leaf, value1) + 1;
+
+	// The search for the gap finds any record with the key right before it
+	if (file->header.flags & BT_UNIQUE && pos > 0) {
+		leaf_key(file, leaf, pos - 1, last);
+		if (!compare_key(file, last, value1)) {
+			return -1;
+		}
+	}
+
+	if (file->max_run && posting_takes(file, leaf, value1, &pos)) {
+		return posting_add(file, leaf, pos, value1, value2);
+	}
 
 	shift_records(file, leaf, pos);                  // Shift 1 to the right
 	set_record(file, leaf, pos, value1, value2);  // Write record in the gap
 	leaf->record_count++;
+
+	return pos;
 }
 
 
 // B-Tree Methods
-int compare_key(struct file_entry *file, void *key, void *value)
+void normalize_key(struct file_entry *file, void *dst, void *key)
 {
+	int bits;
+
 	switch (file->header.field_type[0]) {
 	case 'f':
-		return (int) (*(float *) key - *(float *) value);
+		/* IEEE floats order like sign-magnitude ints. Flipping the
+		 * magnitude of negative ones makes them order like plain ints.
+		 * -0.0 becomes 0.0 so that both compare equal */
+		memcpy(&bits, key, sizeof(bits));
+		if (*(float *) key == 0.0f) {
+			bits = 0;
+		} else if (bits < 0) {
+			bits ^= 0x7fffffff;
+		}
+		memcpy(dst, &bits, sizeof(bits));
+		break;
 	case 'c':
-		return strncmp(key, value, file->header.field_length[0]);
+		// Copies up to the terminator and zero-pads the rest
+		strncpy(dst, key, file->key_size);
+		break;
 	default: // INTEGER
-		return *(int *) key - *(int *) value;
+		memcpy(dst, key, sizeof(int));
+	}
+}
+
+void denormalize_key(struct file_entry *file, void *dst, void *key)
+{
+	int bits;
+
+	if (file->header.field_type[0] != 'f') {
+		memcpy(dst, key, file->key_size);
+		return;
+	}
+
+	memcpy(&bits, key, sizeof(bits));
+	if (bits < 0) {
+		bits ^= 0x7fffffff;
+	}
+	memcpy(dst, &bits, sizeof(bits));
+}
+
+int compare_key(struct file_entry *file, void *key, void *value)
+{
+	return file->compare(key, value, file->key_size);
+}
+
+void separator_key(struct file_entry *file, void *last, void *first)
+{
+	const char *l = last;
+	char *f = first;
+	int i = 0;
+
+	if (file->header.field_type[0] != 'c') {
+		return;
+	}
+
+	while (i < file->key_size && l[i] == f[i]) {
+		i++;
+	}
+
+	// Equal keys (a run cut in two) can't be told apart any sooner
+	if (i < file->key_size) {
+		memset(f + i + 1, 0, file->key_size - i - 1);
 	}
 }
 
-int bt_search(struct file_entry *file, void *key, struct stack_node **parent)
+int bt_search(struct file_entry *file, void *key, struct stack *parent)
 {
-	BF_Block *bl;
+	return bt_search_bounded(file, key, parent, NULL);
+}
+
+int bt_search_bounded(struct file_entry *file, void *key,
+                      struct stack *parent, struct bt_bounds *bounds)
+{
+	PF_Page *bl = file->search_page;
 	BT_Node *node;
 	int next_block;
 	int i;
 
 	if (parent) {     // Populate the stack IF it has been requested (!NULL)
-		*parent = NULL;
+		parent->count = 0;
 	}
 
-	next_block = file->header.root;        // Start our search from the root
+	if (bounds) {
+		bounds->has_low = 0;
+		bounds->has_high = 0;
+	}
 
-	BF_Block_Init(&bl);
+	next_block = file->header.root;        // Start our search from the root
 
 	while (next_block) {
-		BF_GetBlock(file->fd, next_block, bl);
-		node = (BT_Node *) BF_Block_GetData(bl);
+		PF_GetPage(&file->pf, next_block, bl);
+		node = (BT_Node *) PF_Page_GetData(bl);
 
 		/* If we reached a leaf node, we're done.
 		 * Otherwise we're still in a node (parent) block.
 		 * In the stack you go! */
 		if (node->is_leaf) {
+			PF_UnpinPage(bl);
 			break;
 		} else if (parent) {
 			stack_push(parent, next_block);
@@ -339,11 +2311,53 @@ int bt_search(struct file_entry *file, void *key, struct stack_node **parent)
 
 		i = node_find(file, node, key);
 
+		/* The keys either side of the pointer we follow bound the leaf.
+		 * Those of lower levels are tighter */
+		if (bounds && i > 0) {
+			node_key(file, node, i - 1, bounds->low);
+			bounds->has_low = 1;
+		}
+
+		if (bounds && i < node->key_count) {
+			node_key(file, node, i, bounds->high);
+			bounds->has_high = 1;
+		}
+
 		next_block = *pointer(file, node, i);
-		BF_UnpinBlock(bl);
+		PF_UnpinPage(bl);
 	};
 
-	BF_Block_Destroy(&bl);
+	return next_block;
+}
+
+int bt_search_first(struct file_entry *file, void *key)
+{
+	PF_Page *bl = file->search_page;
+	BT_Node *node;
+	int next_block = file->header.root;
+
+	while (next_block) {
+		if (PF_GetPage(&file->pf, next_block, bl) != BF_OK) {
+			return 0;
+		}
+
+		node = (BT_Node *) PF_Page_GetData(bl);
+
+		if (node->is_leaf) {
+			PF_UnpinPage(bl);
+			break;
+		}
+
+		// Equal keys send us to the left, where their run may start
+		next_block = *pointer(file, node, node_find_first(file, node, key));
+		PF_UnpinPage(bl);
+	}
 
 	return next_block;
 }
+
+int bt_in_bounds(struct file_entry *file, struct bt_bounds *bounds, void *key)
+{
+	return (!bounds->has_low || compare_key(file, bounds->low, key) <= 0) &&
+	       (!bounds->has_high || compare_key(file, key, bounds->high) < 0);
+}
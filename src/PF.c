@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bf.h"
+#include "PF.h"
+
+#define CACHE_LINE 64
+
+struct pf_frame {
+	int page_num;                          // -1 if the frame is free
+	int pins;
+	int dirty;
+	int referenced;                        // Second chance for the clock
+	struct pf_frame *next;                 // Bucket chain
+	char *data;
+};
+
+int PF_ValidPageSize(int page_size)
+{
+	// A power of two, from one BF block up to PF_MAX_PAGE_SIZE
+	return page_size >= BF_BLOCK_SIZE && page_size <= PF_MAX_PAGE_SIZE &&
+	       !(page_size & (page_size - 1));
+}
+
+void PF_Page_Init(PF_Page **page)
+{
+	*page = calloc(1, sizeof(**page));
+
+	if (*page) {
+		BF_Block_Init(&(*page)->block);
+	}
+}
+
+void PF_Page_Destroy(PF_Page **page)
+{
+	BF_Block_Destroy(&(*page)->block);
+	free(*page);
+	*page = NULL;
+}
+
+void PF_Page_SetDirty(PF_Page *page)
+{
+	if (page->frame) {
+		page->frame->dirty = 1;
+	} else {
+		BF_Block_SetDirty(page->block);
+	}
+}
+
+char *PF_Page_GetData(const PF_Page *page)
+{
+	if (page->frame) {
+		return page->frame->data;
+	}
+
+	return BF_Block_GetData(page->block);
+}
+
+// Page cache
+static struct pf_frame **bucket(PF_File *file, int page_num)
+{
+	return &file->buckets[page_num % file->frame_count];
+}
+
+static struct pf_frame *lookup(PF_File *file, int page_num)
+{
+	struct pf_frame *frame = *bucket(file, page_num);
+
+	while (frame && frame->page_num != page_num) {
+		frame = frame->next;
+	}
+
+	return frame;
+}
+
+static void unlink_frame(PF_File *file, struct pf_frame *frame)
+{
+	struct pf_frame **link = bucket(file, frame->page_num);
+
+	while (*link != frame) {
+		link = &(*link)->next;
+	}
+
+	*link = frame->next;
+	frame->page_num = -1;
+}
+
+// Copy the page in <frame> over its BF blocks
+static BF_ErrorCode write_back(PF_File *file, struct pf_frame *frame)
+{
+	BF_ErrorCode code;
+	int i;
+
+	for (i = 0; i < file->blocks; ++i) {
+		code = BF_GetBlock(file->fd, frame->page_num * file->blocks + i,
+		                   file->io);
+		if (code != BF_OK) {
+			return code;
+		}
+
+		memcpy(BF_Block_GetData(file->io),
+		       frame->data + i * BF_BLOCK_SIZE,
+		       BF_BLOCK_SIZE);
+
+		BF_Block_SetDirty(file->io);
+		BF_UnpinBlock(file->io);
+	}
+
+	frame->dirty = 0;
+
+	return BF_OK;
+}
+
+/* Find a frame for a new page: a free one, or the first unpinned one the
+ * clock hand finds without its second chance */
+static BF_ErrorCode victim(PF_File *file, struct pf_frame **found)
+{
+	struct pf_frame *frame = NULL;
+	BF_ErrorCode code;
+	int i;
+
+	// Two turns: the first may only be clearing reference bits
+	for (i = 0; i < 2 * file->frame_count; ++i) {
+		frame = &file->frames[file->hand];
+		file->hand = (file->hand + 1) % file->frame_count;
+
+		if (frame->page_num == -1) {
+			break;
+		} else if (frame->pins) {
+			continue;
+		} else if (frame->referenced) {
+			frame->referenced = 0;
+			continue;
+		}
+
+		if (frame->dirty && (code = write_back(file, frame)) != BF_OK) {
+			return code;
+		}
+
+		unlink_frame(file, frame);
+		break;
+	}
+
+	if (i == 2 * file->frame_count) {
+		return BF_FULL_MEMORY_ERROR;
+	}
+
+	*found = frame;
+
+	return BF_OK;
+}
+
+// Cache <page_num> in <frame>, pinned in <page> (unpinned if NULL)
+static void attach(PF_File *file, struct pf_frame *frame, int page_num, PF_Page *page)
+{
+	struct pf_frame **head = bucket(file, page_num);
+
+	frame->page_num = page_num;
+	frame->pins = page != NULL;
+	frame->referenced = 1;
+	frame->next = *head;
+	*head = frame;
+
+	if (page) {
+		page->file = file;
+		page->frame = frame;
+	}
+}
+
+// Copy the BF blocks of <page_num> into <frame>
+static BF_ErrorCode read_in(PF_File *file, struct pf_frame *frame, int page_num)
+{
+	BF_ErrorCode code;
+	int i;
+
+	for (i = 0; i < file->blocks; ++i) {
+		code = BF_GetBlock(file->fd, page_num * file->blocks + i, file->io);
+		if (code != BF_OK) {
+			return code;
+		}
+
+		memcpy(frame->data + i * BF_BLOCK_SIZE,
+		       BF_Block_GetData(file->io),
+		       BF_BLOCK_SIZE);
+
+		BF_UnpinBlock(file->io);
+	}
+
+	frame->dirty = 0;
+
+	return BF_OK;
+}
+
+BF_ErrorCode PF_OpenFile(PF_File *file, int fd, int page_size)
+{
+	int i;
+
+	file->fd = fd;
+	file->page_size = page_size;
+	file->blocks = page_size / BF_BLOCK_SIZE;
+	file->frames = NULL;
+	file->buckets = NULL;
+	file->frame_count = 0;
+	file->hand = 0;
+	file->io = NULL;
+
+	BF_Block_Init(&file->io);
+
+	if (file->blocks == 1) {
+		return BF_OK;
+	}
+
+	file->frame_count = PF_CACHE_SIZE / page_size;
+	if (file->frame_count < PF_MIN_FRAMES) {
+		file->frame_count = PF_MIN_FRAMES;
+	}
+
+	file->frames = calloc(file->frame_count, sizeof(*file->frames));
+	file->buckets = calloc(file->frame_count, sizeof(*file->buckets));
+	if (!file->frames || !file->buckets) {
+		PF_CloseFile(file);
+		return BF_ERROR;
+	}
+
+	for (i = 0; i < file->frame_count; ++i) {
+		file->frames[i].page_num = -1;
+		file->frames[i].data = aligned_alloc(CACHE_LINE, page_size);
+
+		if (!file->frames[i].data) {
+			PF_CloseFile(file);
+			return BF_ERROR;
+		}
+	}
+
+	return BF_OK;
+}
+
+BF_ErrorCode PF_CloseFile(PF_File *file)
+{
+	BF_ErrorCode code = BF_OK;
+	int i;
+
+	for (i = 0; i < file->frame_count && file->frames; ++i) {
+		if (file->frames[i].page_num != -1 && file->frames[i].dirty &&
+		    code == BF_OK) {
+			code = write_back(file, &file->frames[i]);
+		}
+
+		free(file->frames[i].data);
+	}
+
+	free(file->frames);
+	free(file->buckets);
+	file->frames = NULL;
+	file->buckets = NULL;
+	file->frame_count = 0;
+
+	if (file->io) {
+		BF_Block_Destroy(&file->io);
+	}
+
+	return code;
+}
+
+BF_ErrorCode PF_GetPageCounter(PF_File *file, int *pages_num)
+{
+	BF_ErrorCode code = BF_GetBlockCounter(file->fd, pages_num);
+
+	*pages_num /= file->blocks;
+
+	return code;
+}
+
+BF_ErrorCode PF_AllocatePage(PF_File *file, PF_Page *page)
+{
+	struct pf_frame *frame;
+	BF_ErrorCode code;
+	int i, page_num;
+
+	if (file->blocks == 1) {
+		page->file = file;
+		page->frame = NULL;
+		return BF_AllocateBlock(file->fd, page->block);
+	}
+
+	if ((code = PF_GetPageCounter(file, &page_num)) != BF_OK ||
+	    (code = victim(file, &frame)) != BF_OK) {
+		return code;
+	}
+
+	// Reserve the blocks now. Their contents follow on write back
+	for (i = 0; i < file->blocks; ++i) {
+		if ((code = BF_AllocateBlock(file->fd, file->io)) != BF_OK) {
+			return code;
+		}
+
+		BF_UnpinBlock(file->io);
+	}
+
+	memset(frame->data, 0, file->page_size);
+	frame->dirty = 1;
+	attach(file, frame, page_num, page);
+
+	return BF_OK;
+}
+
+BF_ErrorCode PF_GetPage(PF_File *file, int page_num, PF_Page *page)
+{
+	struct pf_frame *frame;
+	BF_ErrorCode code;
+	int pages_num;
+
+	if (file->blocks == 1) {
+		page->file = file;
+		page->frame = NULL;
+		return BF_GetBlock(file->fd, page_num, page->block);
+	}
+
+	if ((frame = lookup(file, page_num))) {
+		frame->pins++;
+		frame->referenced = 1;
+
+		page->file = file;
+		page->frame = frame;
+
+		return BF_OK;
+	}
+
+	PF_GetPageCounter(file, &pages_num);
+	if (page_num < 0 || page_num >= pages_num) {
+		return BF_INVALID_BLOCK_NUMBER_ERROR;
+	}
+
+	if ((code = victim(file, &frame)) != BF_OK ||
+	    (code = read_in(file, frame, page_num)) != BF_OK) {
+		return code;
+	}
+
+	attach(file, frame, page_num, page);
+
+	return BF_OK;
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+BF_ErrorCode PF_Prefetch(PF_File *file, int *pages, int count)
+{
+	struct pf_frame *frame;
+	BF_ErrorCode code;
+	int i, pages_num;
+
+	qsort(pages, count, sizeof(*pages), compare_pages);
+	PF_GetPageCounter(file, &pages_num);
+
+	// Never more than a quarter of the cache
+	if (file->blocks > 1 && count > file->frame_count / 4) {
+		count = file->frame_count / 4;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (pages[i] < 0 || pages[i] >= pages_num) {
+			continue;
+		}
+
+		if (file->blocks == 1) {
+			if ((code = BF_GetBlock(file->fd, pages[i], file->io)) != BF_OK) {
+				return code;
+			}
+
+			BF_UnpinBlock(file->io);
+		} else if (!lookup(file, pages[i])) {
+			if ((code = victim(file, &frame)) != BF_OK ||
+			    (code = read_in(file, frame, pages[i])) != BF_OK) {
+				return code;
+			}
+
+			attach(file, frame, pages[i], NULL);
+		}
+	}
+
+	return BF_OK;
+}
+
+BF_ErrorCode PF_UnpinPage(PF_Page *page)
+{
+	if (!page->frame) {
+		return BF_UnpinBlock(page->block);
+	}
+
+	page->frame->pins--;
+
+	return BF_OK;
+}